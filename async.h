@@ -0,0 +1,389 @@
+// async.h - asynchronous functions returning with xlAsyncReturn
+/*
+	void WINAPI xll_mc(double n, AsyncHandle* h)
+	{
+		async::call(h, [n](const async::token& t) {
+			double s = 0;
+			for (double i = 0; i < n && !t.cancelled(); ++i) ...
+			return OPER12(s);
+		});
+	}
+	constexpr Function mc = { .procedure = L"xll_mc"_xl, .typeText = TypeText<xll_mc>, ... };
+*/
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "xlregister.h"
+#ifdef _DEBUG
+#include <stdexcept>
+#include "host.h"
+#endif
+
+namespace xll {
+
+	// Work-stealing pool. Workers pop from the front of their own queue
+	// and steal from the back of the others when it is empty.
+	class thread_pool {
+		struct queue {
+			std::mutex m;
+			std::deque<std::function<void()>> q;
+		};
+		size_t n;
+		std::unique_ptr<queue[]> queues;
+		std::vector<std::thread> workers;
+		std::atomic<size_t> next;    // round-robin submission
+		std::atomic<size_t> queued;  // in queues
+		std::atomic<size_t> pending; // submitted and not finished
+		std::mutex m;
+		std::condition_variable work, idle;
+		bool stop;
+
+		bool pop(size_t i, std::function<void()>& f, bool front)
+		{
+			queue& q = queues[i];
+			std::lock_guard lock(q.m);
+			if (q.q.empty()) {
+				return false;
+			}
+			if (front) {
+				f = std::move(q.q.front());
+				q.q.pop_front();
+			}
+			else {
+				f = std::move(q.q.back());
+				q.q.pop_back();
+			}
+			--queued;
+
+			return true;
+		}
+		bool steal(size_t i, std::function<void()>& f)
+		{
+			for (size_t k = 1; k < n; ++k) {
+				if (pop((i + k) % n, f, false)) {
+					return true;
+				}
+			}
+
+			return false;
+		}
+		void run(size_t i)
+		{
+			for (;;) {
+				std::function<void()> f;
+				if (pop(i, f, true) || steal(i, f)) {
+					f();
+					if (--pending == 0) {
+						std::lock_guard lock(m);
+						idle.notify_all();
+					}
+					continue;
+				}
+
+				std::unique_lock lock(m);
+				work.wait(lock, [this] { return stop || queued > 0; });
+				if (stop && queued == 0) {
+					return;
+				}
+			}
+		}
+	public:
+		explicit thread_pool(size_t n_ = std::thread::hardware_concurrency())
+			: n(std::max<size_t>(n_, 1)), queues(new queue[n]), next(0), queued(0), pending(0), stop(false)
+		{
+			for (size_t i = 0; i < n; ++i) {
+				workers.emplace_back(&thread_pool::run, this, i);
+			}
+		}
+		thread_pool(const thread_pool&) = delete;
+		thread_pool& operator=(const thread_pool&) = delete;
+		// Run what is queued then join.
+		~thread_pool()
+		{
+			{
+				std::lock_guard lock(m);
+				stop = true;
+			}
+			work.notify_all();
+			for (auto& w : workers) {
+				if (w.joinable()) {
+					w.join();
+				}
+			}
+		}
+
+		// Drop what is queued, wait for running functions, and join.
+		// Call before the module unloads so no thread is joined under the loader lock.
+		void shutdown()
+		{
+			{
+				std::lock_guard lock(m);
+				stop = true;
+			}
+			for (size_t i = 0; i < n; ++i) {
+				std::lock_guard lock(queues[i].m);
+				size_t k = queues[i].q.size();
+				queues[i].q.clear();
+				queued -= k;
+				pending -= k;
+			}
+			{
+				std::lock_guard lock(m);
+				idle.notify_all();
+			}
+			work.notify_all();
+			for (auto& w : workers) {
+				if (w.joinable()) {
+					w.join();
+				}
+			}
+		}
+
+		size_t size() const
+		{
+			return n;
+		}
+
+		// f must not throw. Return false after shutdown.
+		bool try_submit(std::function<void()> f)
+		{
+			{
+				std::lock_guard lock(m);
+				if (stop) {
+					return false;
+				}
+				++pending;
+				{
+					queue& q = queues[next++ % n];
+					std::lock_guard qlock(q.m);
+					q.q.push_back(std::move(f));
+				}
+				++queued;
+			}
+			work.notify_one();
+
+			return true;
+		}
+		void submit(std::function<void()> f)
+		{
+			bool submitted = try_submit(std::move(f));
+			ensure(submitted);
+		}
+
+		// Block until every submitted function has finished.
+		void wait()
+		{
+			std::unique_lock lock(m);
+			idle.wait(lock, [this] { return pending == 0; });
+		}
+	};
+
+	// Async handle argument passed by Excel. Registers as X.
+	struct AsyncHandle : XLOPER12 { };
+
+	namespace detail {
+		template<> struct type_code<AsyncHandle*> { static constexpr char code[] = "X"; };
+		template<> struct type_code<void> { static constexpr char code[] = ">"; };
+	}
+
+	namespace async {
+
+		// Incremented when Excel cancels a calculation.
+		inline std::atomic<unsigned> generation = 0;
+
+		inline void cancel()
+		{
+			++generation;
+		}
+
+		// Captures the calculation an async call belongs to.
+		class token {
+			unsigned g;
+		public:
+			token()
+				: g(generation.load())
+			{ }
+			bool cancelled() const
+			{
+				return g != generation.load(std::memory_order_relaxed);
+			}
+		};
+
+		namespace detail {
+			inline std::atomic<bool> pool_started = false;
+
+			inline void async_return(XLOPER12 h, XLOPER12 o)
+			{
+				XLOPER12* args[2] = { &h, &o };
+				XLOPER12 ret = { .xltype = xltypeNil };
+				traits<XLOPER12>::Excelv(xlAsyncReturn, &ret, 2, args); // xlretInvAsynchronousContext if cancelled
+			}
+		}
+
+		// Shared by all async functions and sized to the cores, started on first use.
+		inline thread_pool& pool()
+		{
+			static thread_pool pool;
+			detail::pool_started = true;
+
+			return pool;
+		}
+
+		// Cancel outstanding calls and join the pool if it was started. Called by xlAutoClose.
+		inline void shutdown()
+		{
+			cancel();
+			if (detail::pool_started) {
+				pool().shutdown();
+			}
+		}
+
+		// Run f(token) on the pool and return its OPER12 result to Excel.
+		// Nothing is returned if the calculation was cancelled.
+		// Returns #VALUE! right away if the pool has been shut down.
+		template<class F>
+		inline void call(const XLOPER12* handle, F&& f, thread_pool& p = pool())
+		{
+			bool submitted = p.try_submit([h = *handle, t = token(), f = std::forward<F>(f)]() mutable {
+				OPER12 o;
+				try {
+					o = f(static_cast<const token&>(t));
+				}
+				catch (...) {
+					o = OPER12(XlErr::Value);
+				}
+				if (t.cancelled()) {
+					return;
+				}
+				detail::async_return(h, o);
+			});
+			if (!submitted) {
+				detail::async_return(*handle, Err12(XlErr::Value));
+			}
+		}
+
+		// Command called by Excel when a calculation is cancelled.
+		inline constexpr Function cancel_command = {
+			.procedure = L"xll_async_cancel"_xl,
+			.typeText = L"J"_xl,
+			.functionText = L"XLL.ASYNC.CANCEL"_xl,
+			.macroType = Num(2),
+		};
+
+		// Register cancel_command for xleventCalculationCanceled.
+		inline bool register_cancel()
+		{
+			OPER module = Excel(xlGetName);
+			if (Register(cancel_command, module).xltype != xltypeNum) {
+				return false;
+			}
+			OPER12 event(xleventCalculationCanceled);
+			XLOPER12* args[2] = { const_cast<XLOPER12*>(&cancel_command.functionText), &event };
+			XLOPER12 ret = { .xltype = xltypeNil };
+
+			return xlretSuccess == traits<XLOPER12>::Excelv(xlEventRegister, &ret, 2, args);
+		}
+
+	} // namespace async
+
+#ifdef _DEBUG
+	inline void test_async()
+	{
+		{
+			std::atomic<int> n = 0;
+			thread_pool p(4);
+			ensure(p.size() == 4);
+			for (int i = 0; i < 1000; ++i) {
+				p.submit([&n] { ++n; });
+			}
+			p.wait();
+			ensure(n == 1000);
+		}
+		{
+			thread_pool p(2);
+			p.submit([] { });
+			p.shutdown();
+			p.shutdown();
+			bool thrown = false;
+			try {
+				p.submit([] { });
+			}
+			catch (const std::exception&) {
+				thrown = true;
+			}
+			ensure(thrown);
+		}
+		{
+			host h;
+			h.install();
+			thread_pool p(2);
+			auto handle = [](size_t i) {
+				return XLOPER12{ .val = {.bigdata = {.h = {.hdata = reinterpret_cast<HANDLE>(i + 1)}}}, .xltype = xltypeBigData };
+			};
+			const size_t n = 10;
+			for (size_t i = 0; i < n; ++i) {
+				XLOPER12 x = handle(i);
+				async::call(&x, [i](const async::token&) {
+					if (i == 0) {
+						throw std::runtime_error("failed");
+					}
+					return OPER12(static_cast<double>(i));
+				}, p);
+			}
+			p.wait();
+			ensure(h.async_returns.size() == n);
+			for (const auto& [hdata, o] : h.async_returns) {
+				size_t i = reinterpret_cast<size_t>(hdata) - 1;
+				ensure(i < n);
+				ensure(o == (i == 0 ? OPER12(XlErr::Value) : OPER12(static_cast<double>(i))));
+			}
+
+			// cancelled calls do not return
+			std::atomic<bool> go = false;
+			XLOPER12 x = handle(n);
+			async::call(&x, [&go](const async::token&) {
+				while (!go) {
+					std::this_thread::yield();
+				}
+				return OPER12(1.5);
+			}, p);
+			async::cancel();
+			go = true;
+			p.wait();
+			ensure(h.async_returns.size() == n);
+
+			// #VALUE! after shutdown instead of throwing
+			p.shutdown();
+			x = handle(n + 1);
+			async::call(&x, [](const async::token&) { return OPER12(1.5); }, p);
+			ensure(h.async_returns.size() == n + 1);
+			ensure(h.async_returns.back().second == OPER12(XlErr::Value));
+		}
+		{
+			async::shutdown(); // does not build the pool
+			ensure(!async::detail::pool_started);
+		}
+		{
+			async::token t;
+			ensure(!t.cancelled());
+			async::cancel();
+			ensure(t.cancelled());
+			ensure(!async::token().cancelled());
+		}
+		{
+			using mc = void(*)(double, AsyncHandle*);
+			constexpr const XLOPERX& t = TypeText<mc(nullptr)>;
+			static_assert(3 == t.val.str[0]);
+			static_assert('>' == t.val.str[1] && 'B' == t.val.str[2] && 'X' == t.val.str[3]);
+		}
+	}
+#endif // _DEBUG
+
+} // namespace xll
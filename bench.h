@@ -0,0 +1,473 @@
+// bench.h - timings of optimized paths against what they replaced
+// Define XLL_BENCH to build. xlauto.cpp exports the table of run() as
+// xll_bench. test.cpp prints that and hosted(), whose benchmarks install
+// the stand-in host and cannot run inside Excel.
+#pragma once
+#include <chrono>
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+#include "excel.h"
+#include "fp.h"
+#include "host.h"
+#include "instrument.h"
+#include "multi.h"
+#include "serial.h"
+#include "win_mem_view.h"
+#include "xlregister.h"
+#include "xlset.h"
+#include "oper.h"
+
+namespace xll::bench {
+
+	// Seconds and count of one benchmark.
+	struct result {
+		const char* name;
+		size_t n;         // operations or cells per pass
+		double baseline;  // seconds per operation or cell before
+		double optimized; // seconds per operation or cell after
+		size_t baseline_calls = 0;  // callbacks into the host before
+		size_t optimized_calls = 0; // callbacks into the host after
+	};
+
+	// Results feed this so the optimizer cannot drop the work producing them.
+	inline volatile size_t sink = 0;
+
+	// Seconds per call of f(i) for i in [0, n).
+	template<class F>
+	inline double time(size_t n, F&& f)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < n; ++i) {
+			f(i);
+		}
+		std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0;
+
+		return dt.count() / static_cast<double>(n ? n : 1);
+	}
+
+	// Copy and destroy short string OPERs. The baseline allocates the counted
+	// string on the heap the way alloc_str did before strings were stored inline.
+	inline result sso(size_t n = 1'000'000)
+	{
+		const OPER12 s(L"AB");
+		ensure(s.is_sso());
+		const XCHAR* str = s.val.str;
+
+		double heap = time(n, [str](size_t) {
+			XCHAR* p = new XCHAR[str[0] + 1];
+			std::copy(str, str + str[0] + 1, p);
+			sink = sink + p[1];
+			delete[] p;
+		});
+		double inline_ = time(n, [&s](size_t) {
+			OPER12 o(s);
+			sink = sink + o.val.str[1];
+		});
+
+		return result{ "sso", n, heap, inline_ };
+	}
+
+	// Sum a 1000 x 1000 range of numbers per cell. The baseline iterates
+	// over the cells of a Multi, the optimized path uses an FP12 kernel.
+	inline result fp_sum(INT32 r = 1000, INT32 c = 1000, size_t reps = 10)
+	{
+		OPER12 m(r, c);
+		FPX a(r, c);
+		for (size_t i = 0; i < a.size(); ++i) {
+			a[i] = static_cast<double>(i % 7);
+			m[static_cast<int>(i)] = OPER12(a[i]);
+		}
+		size_t n = a.size();
+
+		double multi = time(reps, [&m](size_t) {
+			double s = 0;
+			for (const XLOPER12* x = begin(m); x != end(m); ++x) {
+				s += as_num(*x);
+			}
+			sink = sink + static_cast<size_t>(s);
+		}) / static_cast<double>(n);
+		double fp12 = time(reps, [&a](size_t) {
+			sink = sink + static_cast<size_t>(fp::sum(a.view()));
+		}) / static_cast<double>(n);
+
+		return result{ "fp_sum", n, multi, fp12 };
+	}
+
+	// 1000 x 1000 Multi where cell i has type mix[i % mix.size()].
+	inline OPER12 mixed(std::initializer_list<DWORD> mix, INT32 r = 1000, INT32 c = 1000)
+	{
+		OPER12 m(r, c);
+		std::vector<DWORD> t(mix);
+		for (int i = 0; i < static_cast<int>(m.size()); ++i) {
+			switch (t[i % t.size()]) {
+			case xltypeNum:
+				m[i] = OPER12(1.5);
+				break;
+			case xltypeStr:
+				m[i] = OPER12(L"ab");
+				break;
+			case xltypeBool:
+				m[i] = OPER12(true);
+				break;
+			case xltypeErr:
+				m[i] = OPER12(XlErr::NA);
+				break;
+			case xltypeInt:
+				m[i] = OPER12(7);
+				break;
+			}
+		}
+
+		return m;
+	}
+
+	// Extract numbers per cell with to_num against an as_num loop.
+	inline result to_num(const char* name, const OPER12& m, size_t reps = 10)
+	{
+		size_t n = m.size();
+		std::vector<double> out(n);
+
+		double loop = time(reps, [&](size_t) {
+			const XLOPER12* p = begin(m);
+			for (size_t i = 0; i < n; ++i) {
+				out[i] = as_num(p[i]);
+			}
+			sink = sink + static_cast<size_t>(out[n - 1] == out[n - 1]);
+		}) / static_cast<double>(n);
+		double bulk = time(reps, [&](size_t) {
+			sink = sink + xll::to_num(m, out.data());
+		}) / static_cast<double>(n);
+
+		return result{ name, n, loop, bulk };
+	}
+
+	// Count types per cell with classify against a switch per cell.
+	inline result classify(const char* name, const OPER12& m, size_t reps = 10)
+	{
+		size_t n = m.size();
+		std::vector<std::uint64_t> mask((n + 63) / 64);
+
+		double loop = time(reps, [&](size_t) {
+			size_t num = 0, str = 0, other = 0;
+			for (const XLOPER12* x = begin(m); x != end(m); ++x) {
+				switch (type(*x)) {
+				case xltypeNum:
+					++num;
+					break;
+				case xltypeStr:
+					++str;
+					break;
+				default:
+					++other;
+				}
+			}
+			sink = sink + num + str + other;
+		}) / static_cast<double>(n);
+		double bulk = time(reps, [&](size_t) {
+			sink = sink + xll::classify(m, xltypeNum, mask.data())[xltypeStr];
+		}) / static_cast<double>(n);
+
+		return result{ name, n, loop, bulk };
+	}
+
+	// Cost of recording a callback. The baseline calls a no-op callback
+	// directly and optimized calls it through instrument::call.
+	inline result instrumented(size_t n = 1'000'000)
+	{
+		// through a volatile pointer so neither call is inlined away
+		static int (* volatile callback)(int) = [](int xlfn) { return xlfn & 1; };
+		const int xlfn = 0x7FFF0002; // not a real function
+
+		double direct = time(n, [](size_t) {
+			sink = sink + callback(xlfn);
+		});
+		double recorded = time(n, [](size_t) {
+			sink = sink + instrument::call(xlfn, [] { return callback(xlfn); });
+		});
+
+		return result{ "instrumented", n, direct, recorded };
+	}
+
+	// Append 256 1MB chunks to a std::vector, which copies its contents each
+	// time it grows, and to a mem_view, which commits pages in place. n is MB.
+	inline result append(size_t n = 256)
+	{
+		const std::vector<char> chunk(size_t(1) << 20, 'x');
+
+		double vector = time(1, [&](size_t) {
+			std::vector<char> v;
+			for (size_t i = 0; i < n; ++i) {
+				v.insert(v.end(), chunk.begin(), chunk.end());
+			}
+			sink = sink + v.size();
+		}) / static_cast<double>(n);
+		double mapped = time(1, [&](size_t) {
+			Win::mem_view<char> v;
+			for (size_t i = 0; i < n; ++i) {
+				v.append(chunk.data(), chunk.size());
+			}
+			sink = sink + v.size();
+		}) / static_cast<double>(n);
+
+		return result{ "append_mb", n, vector, mapped };
+	}
+
+	// Build a 1000 x 100 Multi of long strings ten times with cells from the
+	// default heap and from an arena that is reset after each table.
+	inline result arena(INT32 r = 1000, INT32 c = 100, size_t reps = 10)
+	{
+		const OPER12 s(L"a string longer than inline storage");
+		auto build = [r, c, &s](std::pmr::memory_resource* mr) {
+			OPER12 m(r, c, 0, mr);
+			for (int i = 0; i < static_cast<int>(m.size()); ++i) {
+				m.set(i, s);
+			}
+			sink = sink + m[0].val.str[0];
+		};
+		size_t n = (size_t)r * c;
+
+		double heap = time(reps, [&build](size_t) {
+			build(std::pmr::get_default_resource());
+		}) / static_cast<double>(n);
+		Win::arena a;
+		double arena = time(reps, [&build, &a](size_t) {
+			build(&a);
+			a.reset();
+		}) / static_cast<double>(n);
+
+		return result{ "arena", n, heap, arena };
+	}
+
+	// 1000 x 1000 table, one third strings and the rest numbers.
+	inline OPER12 table_1m()
+	{
+		OPER12 m(1000, 1000);
+		for (int i = 0; i < static_cast<int>(m.size()); ++i) {
+			m[i] = i % 3 ? OPER12(static_cast<double>(i)) : OPER12(L"a string longer than inline");
+		}
+
+		return m;
+	}
+
+	// Write a table with the element-wise FILE form and as one packed value.
+	inline result serial_write(const OPER12& m)
+	{
+		size_t n = m.size();
+
+		double file = time(1, [&m](size_t) {
+			std::FILE* fp = std::tmpfile();
+			ensure(fp);
+			serial::write(fp, m);
+			sink = sink + static_cast<size_t>(std::ftell(fp));
+			std::fclose(fp);
+		}) / static_cast<double>(n);
+		double packed = time(1, [&m](size_t) {
+			Win::mem_view<std::byte> buf;
+			serial::writer w(buf);
+			w << m;
+			sink = sink + buf.size();
+		}) / static_cast<double>(n);
+
+		return result{ "serial_write", n, file, packed };
+	}
+
+	// Sum the numbers and string lengths of a stored table. The baseline rebuilds
+	// it cell by cell with read_oper. The packed stream is validated and read in place.
+	inline result serial_read(const OPER12& m)
+	{
+		size_t n = m.size();
+		auto sum = [](const XLOPER12& x) {
+			return type(x) == xltypeNum ? static_cast<size_t>(x.val.num) : type(x) == xltypeStr ? x.val.str[0] : 0;
+		};
+		std::FILE* fp = std::tmpfile();
+		ensure(fp);
+		serial::write(fp, m);
+		Win::mem_view<std::byte> buf;
+		serial::writer(buf) << m;
+
+		double file = time(1, [&](size_t) {
+			std::rewind(fp);
+			OPER12 o = serial::read_oper(fp);
+			size_t s = 0;
+			for (const XLOPER12* x = begin(o); x != end(o); ++x) {
+				s += sum(*x);
+			}
+			sink = sink + s;
+		}) / static_cast<double>(n);
+		double packed = time(1, [&](size_t) {
+			serial::reader r(buf.data(), buf.size());
+			size_t s = 0;
+			for (serial::view x : r.next().values()) {
+				s += sum(x.value());
+			}
+			sink = sink + s;
+		}) / static_cast<double>(n);
+		std::fclose(fp);
+
+		return result{ "serial_read", n, file, packed };
+	}
+
+	inline std::vector<result> run()
+	{
+		return {
+			sso(),
+			fp_sum(),
+			to_num("to_num_num", mixed({ xltypeNum })),
+			to_num("to_num_half", mixed({ xltypeNum, xltypeStr })),
+			to_num("to_num_mixed", mixed({ xltypeNum, xltypeStr, xltypeBool, xltypeErr, xltypeInt })),
+			classify("classify_num", mixed({ xltypeNum })),
+			classify("classify_mixed", mixed({ xltypeNum, xltypeStr, xltypeBool, xltypeErr, xltypeInt })),
+			instrumented(),
+			append(),
+			arena(),
+			serial_write(table_1m()),
+			serial_read(table_1m()),
+		};
+	}
+
+	// Write 10,000 cells with xlSet per cell and with range_writer. Dense cells
+	// form one 100 x 100 block. Scattered cells are on every other row and column.
+	inline result xlset(const char* name, bool dense)
+	{
+		host h;
+		h.install();
+		std::vector<REF> refs;
+		for (RW i = 0; i < 100; ++i) {
+			for (COL j = 0; j < 100; ++j) {
+				refs.push_back(dense ? REF(i, j) : REF(2 * i, 2 * j));
+			}
+		}
+		size_t n = refs.size();
+		OPER12 v(1.5);
+
+		size_t calls = h.callbacks;
+		double cell = time(n, [&](size_t i) {
+			XLOPER12 x = { .val = {.sref = {.count = 1, .ref = refs[i]}}, .xltype = xltypeSRef };
+			XLOPER12* args[2] = { &x, &v };
+			XLOPER12 res;
+			ensure(xlretSuccess == traits<XLOPER12>::Excelv(xlSet, &res, 2, args));
+		});
+		size_t cell_calls = h.callbacks - calls;
+
+		h.sheet.clear();
+		calls = h.callbacks;
+		range_writer w;
+		double writer = time(n, [&](size_t i) {
+			w.set(refs[i], v);
+			if (i + 1 == n) {
+				w.flush();
+			}
+		});
+
+		return result{ name, n, cell, writer, cell_calls, h.callbacks - calls };
+	}
+
+	// xlCoerce of a string cell with Excel12 returning a new OPER each time
+	// against Call12 reusing one result slot.
+	inline result call(size_t n = 100'000)
+	{
+		host h;
+		h.install();
+		h.sheet[{0, 0}] = OPER12(L"a string longer than inline");
+		OPER12 ref(XLOPER12{ .val = {.sref = {.count = 1, .ref = REF(0, 0)}}, .xltype = xltypeSRef });
+
+		size_t calls = h.callbacks;
+		double fresh = time(n, [&ref](size_t) {
+			OPER12 o = Excel12(xlCoerce, ref);
+			sink = sink + o.val.str[0];
+		});
+		size_t fresh_calls = h.callbacks - calls;
+
+		calls = h.callbacks;
+		Call12 c;
+		double reused = time(n, [&ref, &c](size_t) {
+			sink = sink + c(xlCoerce, ref).val.str[0];
+		});
+
+		return result{ "call", n, fresh, reused, fresh_calls, h.callbacks - calls };
+	}
+
+	// Load time of n registrations. The baseline copies each function's
+	// arguments into OPERs and a vector the way Register used to.
+	inline result registration(size_t n = 2000)
+	{
+		static constexpr XLOPERX help[] = { L"is the first argument"_xl, L"is the second argument"_xl };
+		static constexpr Function f = {
+			.procedure = L"xll_foo"_xl,
+			.typeText = L"BBB$"_xl,
+			.functionText = L"XLL.FOO"_xl,
+			.argumentText = L"x, y"_xl,
+			.category = L"XLL"_xl,
+			.functionHelp = L"call foo"_xl,
+			.argumentHelp = help,
+		};
+		std::vector<Function> fs(n, f);
+		host h;
+		h.install();
+		h.registered.reserve(n);
+
+		size_t calls = h.callbacks;
+		double copied = time(1, [&fs](size_t) {
+			OPER module = Excel(xlGetName);
+			for (const Function& f : fs) {
+				std::vector<OPER> opers = { module, OPER(f.procedure), OPER(f.typeText), OPER(f.functionText),
+					OPER(f.argumentText), OPER(f.macroType), OPER(f.category), OPER(f.shortcutText),
+					OPER(f.helpTopic), OPER(f.functionHelp) };
+				for (const XLOPERX& a : f.argumentHelp) {
+					opers.emplace_back(a);
+				}
+				std::vector<XLOPERX*> args;
+				for (OPER& o : opers) {
+					args.push_back(&o);
+				}
+				XLOPERX id;
+				ensure(xlretSuccess == traits<XLOPERX>::Excelv(xlfRegister, &id, static_cast<int>(args.size()), args.data()));
+			}
+		}) / static_cast<double>(n);
+		size_t copied_calls = h.callbacks - calls;
+
+		h.registered.clear();
+		calls = h.callbacks;
+		double table = time(1, [&fs](size_t) {
+			ensure(fs.size() == Register(std::span<const Function>(fs)));
+		}) / static_cast<double>(n);
+
+		return result{ "registration", n, copied, table, copied_calls, h.callbacks - calls };
+	}
+
+	inline std::vector<result> hosted()
+	{
+		return {
+			call(),
+			registration(),
+			xlset("xlset_dense", true),
+			xlset("xlset_scattered", false),
+		};
+	}
+
+	// Columns are name, n, baseline and optimized seconds, and speedup.
+	inline OPER12 table()
+	{
+		auto v = run();
+		OPER12 o(static_cast<INT32>(v.size() + 1), 5);
+
+		const XCHAR* head[] = { L"name", L"n", L"baseline", L"optimized", L"speedup" };
+		for (int j = 0; j < 5; ++j) {
+			o(0, j) = OPER12(head[j]);
+		}
+		for (int i = 0; i < static_cast<int>(v.size()); ++i) {
+			const auto& r = v[i];
+			o(i + 1, 0) = OPER12(r.name);
+			o(i + 1, 1) = OPER12(static_cast<double>(r.n));
+			o(i + 1, 2) = OPER12(r.baseline);
+			o(i + 1, 3) = OPER12(r.optimized);
+			o(i + 1, 4) = OPER12(r.optimized ? r.baseline / r.optimized : 0.);
+		}
+
+		return o;
+	}
+
+} // namespace xll::bench
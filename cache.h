@@ -0,0 +1,500 @@
+// cache.h - function results persisted across Excel sessions
+/*
+	static cache results("xll.cache", 1 << 30, BUILD);
+
+	LPXLOPER12 WINAPI xll_curve(LPXLOPER12 args)
+	{
+		Context12& context = Context12::get();
+		if (!results.get(L"XLL.CURVE", *args, context.result)) {
+			context.result = curve(*args);
+			results.put(L"XLL.CURVE", *args, context.result);
+		}
+
+		return &context.result;
+	}
+
+	Entries are keyed by function name and argument values and hold the result in
+	serial packed form, so opening the file reads nothing until an entry is used.
+	The least recently used entries are evicted to stay under the size limit.
+	A file with another format or version is discarded. An entry whose checksum
+	fails is dropped when it is first read. Records past the end stored in the
+	header, e.g. left by a crash after clear, are ignored.
+
+	Only values are keys. Arguments containing references, handles, or memory
+	Excel must free are not cached: get returns false and put does nothing.
+
+	The file is opened on first use and only one cache can have it open. If it
+	cannot be opened, e.g. another Excel instance is using it, the cache stays
+	empty, get returns false, and put does nothing.
+*/
+#pragma once
+#include <algorithm>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "hash.h"
+#include "serial.h"
+#include "win_mem_view.h"
+#ifdef _DEBUG
+#include <filesystem>
+#endif
+
+namespace xll {
+
+	class cache {
+		static constexpr uint32_t magic = 0x434C4C58; // XLLC
+		static constexpr uint16_t format = 2;
+
+		struct header {
+			uint32_t magic;
+			uint16_t format;
+			uint16_t xchar;   // sizeof(XCHAR)
+			uint32_t version; // supplied by the add-in
+			uint32_t reserved;
+			uint64_t tick;    // LRU clock
+			uint64_t end;     // bytes in use, the file can be longer after a crash
+		};
+		// Followed by the packed arguments and result.
+		struct record {
+			uint64_t name;     // hash of the function name
+			uint64_t args;     // hash of the arguments seeded with name
+			uint64_t checksum; // of everything after the record
+			uint64_t used;     // tick of last use, 0 if evicted
+			uint64_t bytes;    // including this record
+			uint64_t key;      // bytes of packed arguments
+		};
+		struct key {
+			uint64_t name, args;
+			bool operator==(const key&) const = default;
+		};
+		struct key_hash {
+			size_t operator()(const key& k) const
+			{
+				return static_cast<size_t>(k.args);
+			}
+		};
+		struct entry {
+			size_t offset;
+			bool verified; // checksum checked this session
+		};
+
+		std::string path;
+		uint32_t version;
+		bool opened = false; // tried to open file
+		std::optional<Win::mem_view<std::byte>> file;
+		size_t limit; // bytes of records
+		size_t live;  // bytes of records in the index
+		std::unordered_map<key, entry, key_hash> index;
+		std::mutex m;
+
+		header& head()
+		{
+			return *reinterpret_cast<header*>(file->data());
+		}
+		record& at(size_t offset)
+		{
+			return *reinterpret_cast<record*>(file->data() + offset);
+		}
+		static uint64_t checksum(const record& r)
+		{
+			return xxh64::hash(&r + 1, r.bytes - sizeof(record), r.name ^ r.args);
+		}
+		static key make_key(const XCHAR* name, const XLOPER12& args)
+		{
+			uint64_t h = xxh64::hash(name, xll::len(name) * sizeof(XCHAR));
+
+			return key{ h, hash(args, h) };
+		}
+		// Values only. References and handles would return stale results.
+		static bool keyable(const XLOPER12& x)
+		{
+			if (x.xltype & xlbitXLFree) {
+				return false;
+			}
+			switch (type(x)) {
+			case xltypeRef:
+			case xltypeSRef:
+			case xltypeBigData:
+				return false;
+			case xltypeMulti:
+				return std::all_of(begin(x), end(x), keyable);
+			}
+
+			return true;
+		}
+		static std::vector<uint64_t> packed(const XLOPER12& x)
+		{
+			std::vector<uint64_t> buf(serial::packed_size(x) / sizeof(uint64_t));
+			serial::pack(x, buf.data());
+
+			return buf;
+		}
+
+		// Packed arguments and result fill the record.
+		static bool valid(const record& r)
+		{
+			const std::byte* p = reinterpret_cast<const std::byte*>(&r + 1);
+			size_t n = r.bytes - sizeof(record);
+			try {
+				return r.key < n && serial::validate(p, r.key) == r.key && serial::validate(p + r.key, n - r.key) == n - r.key;
+			}
+			catch (const std::exception&) {
+				return false;
+			}
+		}
+		void erase(decltype(index)::iterator i)
+		{
+			record& r = at(i->second.offset);
+			r.used = 0;
+			live -= r.bytes;
+			index.erase(i);
+		}
+		void init()
+		{
+			index.clear();
+			live = 0;
+			file->reset(sizeof(header));
+			head() = header{ .magic = magic, .format = format, .xchar = sizeof(XCHAR), .version = version, .tick = 1, .end = sizeof(header) };
+		}
+		// Index records before the end up to the first that is incomplete.
+		void scan()
+		{
+			size_t end = static_cast<size_t>(std::min<uint64_t>(head().end, file->size()));
+			size_t offset = sizeof(header);
+			while (offset + sizeof(record) <= end) {
+				const record& r = at(offset);
+				if (r.bytes < sizeof(record) + 2 * sizeof(serial::cell) || r.bytes % 8 || r.bytes > end - offset) {
+					break;
+				}
+				if (r.used) {
+					if (auto i = index.find(key{ r.name, r.args }); i != index.end()) {
+						erase(i); // replaced by a later put
+					}
+					index.emplace(key{ r.name, r.args }, entry{ offset, false });
+					live += r.bytes;
+					head().tick = std::max(head().tick, r.used);
+				}
+				offset += r.bytes;
+			}
+			file->reset(offset);
+			head().end = offset;
+		}
+		// Evict least recently used entries until bytes more fit with some slack.
+		void evict(size_t bytes)
+		{
+			std::vector<std::pair<uint64_t, key>> lru;
+			for (const auto& [k, e] : index) {
+				lru.emplace_back(at(e.offset).used, k);
+			}
+			std::sort(lru.begin(), lru.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+			for (const auto& [used, k] : lru) {
+				if (live + bytes <= limit - limit / 8) {
+					break;
+				}
+				erase(index.find(k));
+			}
+		}
+		// Move records down over evicted ones.
+		void compact_()
+		{
+			std::vector<entry*> es;
+			for (auto& [k, e] : index) {
+				es.push_back(&e);
+			}
+			std::sort(es.begin(), es.end(), [](const entry* a, const entry* b) { return a->offset < b->offset; });
+			size_t offset = sizeof(header);
+			for (entry* e : es) {
+				size_t bytes = at(e->offset).bytes;
+				std::memmove(file->data() + offset, file->data() + e->offset, bytes);
+				e->offset = offset;
+				offset += bytes;
+			}
+			file->reset(offset);
+			head().end = offset;
+		}
+		// Open the file the first time it is needed. Return false if it cannot be.
+		bool open()
+		{
+			if (!opened) {
+				opened = true;
+				try {
+					file.emplace(path.c_str(), sizeof(header) + limit);
+				}
+				catch (const std::exception&) {
+					return false;
+				}
+				if (file->size() < sizeof(header) || head().magic != magic || head().format != format
+					|| head().xchar != sizeof(XCHAR) || head().version != version) {
+					init();
+				}
+				else {
+					scan();
+				}
+			}
+
+			return file.has_value();
+		}
+		auto find_(const XCHAR* name, const XLOPER12& args)
+		{
+			key k = make_key(name, args);
+			auto i = index.find(k);
+			if (i == index.end()) {
+				return i;
+			}
+
+			record& r = at(i->second.offset);
+			if (!i->second.verified) {
+				if (checksum(r) != r.checksum || !valid(r)) {
+					erase(i);
+					return index.end();
+				}
+				i->second.verified = true;
+			}
+			auto a = packed(args);
+			if (a.size() * sizeof(uint64_t) != r.key || 0 != std::memcmp(&r + 1, a.data(), r.key)) {
+				return index.end(); // hash collision
+			}
+			r.used = ++head().tick;
+
+			return i;
+		}
+	public:
+		// Cache in the file at path, created if needed, holding up to max_bytes of entries.
+		cache(const char* path, size_t max_bytes = size_t(1) << 30, uint32_t version = 0)
+			: path(path), version(version), limit(max_bytes), live(0)
+		{ }
+		cache(const cache&) = delete;
+		cache& operator=(const cache&) = delete;
+
+		// True if the file is open, opening it if needed.
+		bool cached()
+		{
+			std::lock_guard lock(m);
+
+			return open();
+		}
+		// Number of entries.
+		size_t size()
+		{
+			std::lock_guard lock(m);
+			open();
+
+			return index.size();
+		}
+		// Bytes used by entries.
+		size_t bytes()
+		{
+			std::lock_guard lock(m);
+			open();
+
+			return live;
+		}
+
+		// Call f(serial::view) with the cached result. The view is valid during the call.
+		template<class F>
+		bool find(const XCHAR* name, const XLOPER12& args, F&& f)
+		{
+			if (!keyable(args)) {
+				return false;
+			}
+
+			std::lock_guard lock(m);
+			if (!open()) {
+				return false;
+			}
+
+			auto i = find_(name, args);
+			if (i == index.end()) {
+				return false;
+			}
+			const record& r = at(i->second.offset);
+			f(serial::view(reinterpret_cast<const std::byte*>(&r + 1) + r.key));
+
+			return true;
+		}
+		// Copy the cached result to result.
+		bool get(const XCHAR* name, const XLOPER12& args, OPER12& result)
+		{
+			return find(name, args, [&result](const serial::view& v) { result = v.oper(); });
+		}
+
+		// Cache result. Return false if args are not values, it is larger than the cache, or the file is not open.
+		bool put(const XCHAR* name, const XLOPER12& args, const XLOPER12& result)
+		{
+			if (!keyable(args)) {
+				return false;
+			}
+			size_t a = serial::packed_size(args);
+			size_t bytes = sizeof(record) + a + serial::packed_size(result);
+			if (bytes > limit) {
+				return false;
+			}
+
+			std::lock_guard lock(m);
+			if (!open()) {
+				return false;
+			}
+			key k = make_key(name, args);
+			if (auto i = index.find(k); i != index.end()) {
+				erase(i);
+			}
+			if (live + bytes > limit) {
+				evict(bytes);
+			}
+			if (file->size() + bytes > sizeof(header) + limit) {
+				compact_();
+			}
+
+			size_t offset = file->size();
+			file->reset(offset + bytes);
+			record& r = at(offset);
+			std::byte* p = reinterpret_cast<std::byte*>(&r + 1);
+			serial::pack(args, p);
+			serial::pack(result, p + a);
+			r = record{ .name = k.name, .args = k.args, .used = ++head().tick, .bytes = bytes, .key = a };
+			r.checksum = checksum(r);
+			head().end = offset + bytes;
+			index.emplace(k, entry{ offset, true });
+			live += bytes;
+
+			return true;
+		}
+
+		// Remove all entries.
+		void clear()
+		{
+			std::lock_guard lock(m);
+			if (open()) {
+				init();
+			}
+		}
+		// Reclaim space of evicted entries.
+		void compact()
+		{
+			std::lock_guard lock(m);
+			if (open()) {
+				compact_();
+			}
+		}
+		// Write to disk.
+		void flush()
+		{
+			std::lock_guard lock(m);
+			if (file) {
+				file->flush();
+			}
+		}
+	};
+
+#ifdef _DEBUG
+	inline void test_cache()
+	{
+		const std::string file = (std::filesystem::temp_directory_path() / "xll_test.cache").string();
+		const char* path = file.c_str();
+		std::filesystem::remove(file);
+		OPER12 args(1, 2);
+		args[0] = OPER12(1.5);
+		args[1] = OPER12(L"a string longer than inline");
+		OPER12 result(2, 2);
+		result[0] = OPER12(L"another string longer than inline");
+		result[3] = OPER12(2.);
+		{
+			cache c(path, 1 << 16, 1);
+			ensure(c.size() == 0);
+			OPER12 o;
+			ensure(!c.get(L"XLL.FOO", args, o));
+			ensure(c.put(L"XLL.FOO", args, result));
+			ensure(c.get(L"XLL.FOO", args, o));
+			ensure(o == result);
+			ensure(!c.get(L"XLL.BAR", args, o));
+			ensure(c.put(L"XLL.BAR", args, OPER12(3.)));
+			ensure(c.find(L"XLL.BAR", args, [](const serial::view& v) { ensure(v.value().val.num == 3.); }));
+			ensure(c.put(L"XLL.BAR", args, OPER12(4.)));
+			ensure(c.size() == 2);
+
+			// references are not keys
+			XLOPER12 ref = { .xltype = xltypeSRef };
+			ref.val.sref.count = 1;
+			ensure(!c.put(L"XLL.REF", ref, result));
+			ensure(!c.get(L"XLL.REF", ref, o));
+			XLOPER12 cells[2] = { { .xltype = xltypeNil }, { .xltype = xltypeBigData } };
+			XLOPER12 multi = { .xltype = xltypeMulti };
+			multi.val.array = { .lparray = cells, .rows = 1, .columns = 2 };
+			ensure(!c.put(L"XLL.REF", multi, result));
+			cells[1] = XLOPER12(Num12(1.));
+			ensure(c.put(L"XLL.REF", multi, result));
+			ensure(c.get(L"XLL.REF", multi, o));
+			XLOPER12 freed = { .val = { .num = 1. }, .xltype = xltypeNum | xlbitXLFree };
+			ensure(!c.put(L"XLL.REF", freed, result));
+			ensure(c.size() == 3);
+
+			// a second cache on the file, as in another Excel instance, runs uncached
+			cache d(path, 1 << 16, 1);
+			ensure(c.cached() && !d.cached());
+			ensure(!d.get(L"XLL.FOO", args, o));
+			ensure(!d.put(L"XLL.FOO", args, result));
+			ensure(d.size() == 0);
+		}
+		{
+			cache c(path, 1 << 16, 1);
+			ensure(c.size() == 3);
+			OPER12 o;
+			ensure(c.get(L"XLL.FOO", args, o) && o == result);
+			ensure(c.get(L"XLL.BAR", args, o) && o == 4.);
+
+			// least recently used are evicted
+			for (int i = 0; i < 1000; ++i) {
+				ensure(c.put(L"XLL.I", OPER12(i), result));
+				ensure(c.get(L"XLL.FOO", args, o));
+			}
+			ensure(c.bytes() <= (1 << 16));
+			ensure(c.get(L"XLL.FOO", args, o) && o == result);
+			ensure(!c.get(L"XLL.BAR", args, o));
+			ensure(c.get(L"XLL.I", OPER12(999), o));
+			ensure(!c.get(L"XLL.I", OPER12(0), o));
+			c.compact();
+		}
+		{
+			// corrupt the last entry
+			Win::mem_view<std::byte> f(path);
+			f[f.size() - 1] ^= std::byte{ 1 };
+		}
+		{
+			cache c(path, 1 << 16, 1);
+			size_t n = c.size();
+			OPER12 o;
+			size_t found = 0;
+			for (int i = 0; i < 1000; ++i) {
+				found += c.get(L"XLL.I", OPER12(i), o);
+			}
+			found += c.get(L"XLL.FOO", args, o);
+			ensure(found == n - 1);
+			ensure(c.size() == n - 1);
+		}
+		{
+			// a crash leaves the file at its old length with the old records in the tail
+			const std::string crashed = file + ".crashed";
+			{
+				cache c(path, 1 << 16, 1);
+				ensure(c.size() > 0);
+				c.clear();
+				c.flush();
+				std::filesystem::copy_file(file, crashed, std::filesystem::copy_options::overwrite_existing);
+			}
+			{
+				cache c(crashed.c_str(), 1 << 16, 1);
+				ensure(c.size() == 0);
+			}
+			std::filesystem::remove(crashed);
+		}
+		{
+			cache c(path, 1 << 16, 2); // new version
+			ensure(c.size() == 0);
+		}
+		std::filesystem::remove(file);
+	}
+#endif // _DEBUG
+
+} // namespace xll
@@ -0,0 +1,762 @@
+// cluster.h - run cluster-safe functions in local worker processes
+/*
+	OPER12 heavy(const OPER12& args) // args is a 1 x n Multi
+	{
+		...
+	}
+	void WINAPI xll_heavy(double x, AsyncHandle* h)
+	{
+		OPER12 args(1, 1);
+		args[0] = OPER12(x);
+		cluster::call(h, heavy, args);
+	}
+
+	Workers are separate processes started from the module containing this code.
+	An XLL is loaded by rundll32 calling the exported xll_cluster_worker, a program
+	is run with worker_flag and must call serve() first thing in main. Functions
+	are sent as offsets in the module, so heavy must be defined in it. Workers
+	cannot call back into Excel. A worker that crashes is replaced and its call
+	returns #VALUE!.
+*/
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char** environ;
+#endif
+#include "async.h"
+#include "serial.h"
+
+namespace xll::cluster {
+
+	// Function run by a worker.
+	using function = OPER12(*)(const OPER12& args);
+
+	// Argument telling a program started as a worker to call serve().
+	inline constexpr char worker_flag[] = "--xll-cluster-worker";
+
+	// Default completion: return the result to Excel.
+	inline int CALLBACK async_return(LPXLOPER12 handle, LPXLOPER12 result)
+	{
+		XLOPER12* args[2] = { handle, result };
+		XLOPER12 ret = { .xltype = xltypeNil };
+
+		return xlretSuccess == traits<XLOPER12>::Excelv(xlAsyncReturn, &ret, 2, args) ? xlHpcRetSuccess : xlHpcRetCallFailed;
+	}
+
+	// True if Excel is running this add-in on a compute cluster node.
+	inline bool running_on_cluster()
+	{
+		XLOPER12 ret = { .xltype = xltypeNil };
+		int rc = traits<XLOPER12>::Excelv(xlRunningOnCluster, &ret, 0, nullptr);
+
+		return rc == xlretSuccess && type(ret) == xltypeBool && ret.val.xbool;
+	}
+
+	namespace detail {
+
+		// Lives in the module containing this code.
+		inline const char here = 0;
+
+#ifdef _WIN32
+		using pipe = HANDLE;
+
+		// Calls are written to in and results read from out.
+		struct process {
+			HANDLE h = nullptr;
+			HANDLE in = INVALID_HANDLE_VALUE;
+			HANDLE out = INVALID_HANDLE_VALUE;
+		};
+
+		// Base address of the module containing p.
+		inline const void* base(const void* p)
+		{
+			HMODULE h = nullptr;
+			ensure(GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+				static_cast<LPCWSTR>(p), &h));
+
+			return h;
+		}
+
+		inline bool write_all(HANDLE h, const void* p_, size_t n)
+		{
+			const char* p = static_cast<const char*>(p_);
+			while (n) {
+				DWORD k = 0;
+				if (!WriteFile(h, p, static_cast<DWORD>(std::min<size_t>(n, 1 << 30)), &k, nullptr) || k == 0) {
+					return false;
+				}
+				p += k;
+				n -= k;
+			}
+
+			return true;
+		}
+		inline bool read_all(HANDLE h, void* p_, size_t n)
+		{
+			char* p = static_cast<char*>(p_);
+			while (n) {
+				DWORD k = 0;
+				if (!ReadFile(h, p, static_cast<DWORD>(std::min<size_t>(n, 1 << 30)), &k, nullptr) || k == 0) {
+					return false;
+				}
+				p += k;
+				n -= k;
+			}
+
+			return true;
+		}
+
+		inline std::wstring module_path(HMODULE h)
+		{
+			std::wstring s(MAX_PATH, 0);
+			for (;;) {
+				DWORD n = GetModuleFileNameW(h, s.data(), static_cast<DWORD>(s.size()));
+				ensure(n > 0);
+				if (n < s.size()) {
+					s.resize(n);
+
+					return s;
+				}
+				s.resize(2 * s.size());
+			}
+		}
+
+		// This program with worker_flag, or rundll32 calling xll_cluster_worker in this DLL.
+		inline std::wstring command()
+		{
+			HMODULE h = static_cast<HMODULE>(const_cast<void*>(base(&here)));
+			std::wstring path = module_path(h);
+			if (h == GetModuleHandleW(nullptr)) {
+				return L"\"" + path + L"\" " + std::wstring(worker_flag, worker_flag + sizeof(worker_flag) - 1);
+			}
+
+			wchar_t sys[MAX_PATH];
+			UINT n = GetSystemDirectoryW(sys, MAX_PATH);
+			ensure(n > 0 && n < MAX_PATH);
+
+			return L"\"" + std::wstring(sys, n) + L"\\rundll32.exe\" \"" + path + L"\",xll_cluster_worker";
+		}
+
+		// Start a worker with pipes as its standard input and output. Only the
+		// child ends of the pipes are inherited.
+		inline process spawn()
+		{
+			std::wstring cmd = command();
+			SECURITY_ATTRIBUTES sa = { .nLength = sizeof(sa), .lpSecurityDescriptor = nullptr, .bInheritHandle = TRUE };
+			HANDLE in_r, in_w, out_r, out_w;
+			ensure(CreatePipe(&in_r, &in_w, &sa, 0));
+			if (!CreatePipe(&out_r, &out_w, &sa, 0)) {
+				CloseHandle(in_r);
+				CloseHandle(in_w);
+				ensure(!"cluster: CreatePipe failed");
+			}
+			SetHandleInformation(in_w, HANDLE_FLAG_INHERIT, 0);
+			SetHandleInformation(out_r, HANDLE_FLAG_INHERIT, 0);
+
+			HANDLE inherit[2] = { in_r, out_w };
+			SIZE_T bytes = 0;
+			InitializeProcThreadAttributeList(nullptr, 1, 0, &bytes);
+			std::vector<char> attributes(bytes);
+			auto list = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(attributes.data());
+			BOOL ok = InitializeProcThreadAttributeList(list, 1, 0, &bytes)
+				&& UpdateProcThreadAttribute(list, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, inherit, sizeof(inherit), nullptr, nullptr);
+
+			STARTUPINFOEXW si = {};
+			si.StartupInfo.cb = sizeof(si);
+			si.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+			si.StartupInfo.hStdInput = in_r;
+			si.StartupInfo.hStdOutput = out_w;
+			si.StartupInfo.hStdError = nullptr;
+			si.lpAttributeList = list;
+			PROCESS_INFORMATION pi = {};
+			ok = ok && CreateProcessW(nullptr, cmd.data(), nullptr, nullptr, TRUE,
+				EXTENDED_STARTUPINFO_PRESENT | CREATE_NO_WINDOW, nullptr, nullptr, &si.StartupInfo, &pi);
+			DeleteProcThreadAttributeList(list);
+			CloseHandle(in_r);
+			CloseHandle(out_w);
+			if (!ok) {
+				CloseHandle(in_w);
+				CloseHandle(out_r);
+				ensure(!"cluster: cannot start worker");
+			}
+			CloseHandle(pi.hThread);
+
+			return process{ .h = pi.hProcess, .in = in_w, .out = out_r };
+		}
+
+		inline void stop(process& p)
+		{
+			if (p.in != INVALID_HANDLE_VALUE) {
+				CloseHandle(p.in);
+			}
+			if (p.out != INVALID_HANDLE_VALUE) {
+				CloseHandle(p.out);
+			}
+			if (p.h) {
+				TerminateProcess(p.h, 0);
+				WaitForSingleObject(p.h, INFINITE);
+				CloseHandle(p.h);
+			}
+			p = process{};
+		}
+		// End the process without touching the pipes so a blocked read on them returns.
+		inline void kill(const process& p)
+		{
+			if (p.h) {
+				TerminateProcess(p.h, 1);
+			}
+		}
+
+		// Take the pipes from standard input and output and point those at NUL.
+		inline void take_stdio(HANDLE& in, HANDLE& out)
+		{
+			HANDLE self = GetCurrentProcess();
+			ensure(DuplicateHandle(self, GetStdHandle(STD_INPUT_HANDLE), self, &in, 0, FALSE, DUPLICATE_SAME_ACCESS));
+			ensure(DuplicateHandle(self, GetStdHandle(STD_OUTPUT_HANDLE), self, &out, 0, FALSE, DUPLICATE_SAME_ACCESS));
+			std::FILE* fp;
+			freopen_s(&fp, "NUL", "r", stdin);
+			freopen_s(&fp, "NUL", "w", stdout);
+		}
+#else
+		using pipe = int;
+
+		// One socket carries calls and results.
+		struct process {
+			pid_t pid = -1;
+			int in = -1;
+			int out = -1;
+		};
+
+		inline const void* base(const void* p)
+		{
+			Dl_info info;
+			ensure(::dladdr(p, &info) && info.dli_fbase);
+
+			return info.dli_fbase;
+		}
+
+		inline bool write_all(int fd, const void* p_, size_t n)
+		{
+			const char* p = static_cast<const char*>(p_);
+			while (n) {
+				ssize_t k = ::send(fd, p, n, MSG_NOSIGNAL);
+				if (k <= 0) {
+					return false;
+				}
+				p += k;
+				n -= static_cast<size_t>(k);
+			}
+
+			return true;
+		}
+		inline bool read_all(int fd, void* p_, size_t n)
+		{
+			char* p = static_cast<char*>(p_);
+			while (n) {
+				ssize_t k = ::recv(fd, p, n, 0);
+				if (k <= 0) {
+					return false;
+				}
+				p += k;
+				n -= static_cast<size_t>(k);
+			}
+
+			return true;
+		}
+
+		// Run this program with worker_flag and a socket as its standard input and
+		// output. posix_spawn execs without running code in a forked copy of this
+		// process, so it is safe while other threads hold locks.
+		inline process spawn()
+		{
+			int sv[2];
+			ensure(0 == ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv));
+			posix_spawn_file_actions_t fa;
+			::posix_spawn_file_actions_init(&fa);
+			::posix_spawn_file_actions_adddup2(&fa, sv[1], 0);
+			::posix_spawn_file_actions_adddup2(&fa, sv[1], 1);
+			char* argv[] = { const_cast<char*>("/proc/self/exe"), const_cast<char*>(worker_flag), nullptr };
+			pid_t pid = -1;
+			int rc = ::posix_spawn(&pid, argv[0], &fa, nullptr, argv, environ);
+			::posix_spawn_file_actions_destroy(&fa);
+			::close(sv[1]);
+			if (rc != 0) {
+				::close(sv[0]);
+				ensure(!"cluster: cannot start worker");
+			}
+
+			return process{ .pid = pid, .in = sv[0], .out = sv[0] };
+		}
+
+		inline void stop(process& p)
+		{
+			if (p.in >= 0) {
+				::close(p.in);
+			}
+			if (p.pid > 0) {
+				::kill(p.pid, SIGKILL);
+				::waitpid(p.pid, nullptr, 0);
+			}
+			p = process{};
+		}
+		inline void kill(const process& p)
+		{
+			if (p.pid > 0) {
+				::kill(p.pid, SIGKILL);
+			}
+		}
+
+		inline void take_stdio(int& in, int& out)
+		{
+			in = out = ::fcntl(0, F_DUPFD_CLOEXEC, 3);
+			ensure(in >= 0);
+			int null = ::open("/dev/null", O_RDWR);
+			ensure(null >= 0);
+			::dup2(null, 0);
+			::dup2(null, 1);
+			::close(null);
+		}
+#endif // _WIN32
+
+		// Offset of f in this module. Workers load the same module at any address.
+		inline uint64_t offset(function f)
+		{
+			const char* p = reinterpret_cast<const char*>(f);
+			const void* b = base(&here);
+			ensure(base(p) == b || !"cluster: function must be defined in this module");
+
+			return static_cast<uint64_t>(p - static_cast<const char*>(b));
+		}
+		inline function at(uint64_t off)
+		{
+			return reinterpret_cast<function>(static_cast<const char*>(base(&here)) + off);
+		}
+
+		// Packed x after its size and tag, sent with one write.
+		inline bool send(pipe p, uint64_t tag, const XLOPER12& x)
+		{
+			size_t n = serial::packed_size(x);
+			std::vector<uint64_t> buf(2 + n / sizeof(uint64_t));
+			buf[0] = n;
+			buf[1] = tag;
+			serial::pack(x, buf.data() + 2);
+
+			return write_all(p, buf.data(), buf.size() * sizeof(uint64_t));
+		}
+		// Value and tag written by send. Return false if the peer is gone.
+		inline bool recv(pipe p, uint64_t& tag, OPER12& o)
+		{
+			uint64_t head[2];
+			if (!read_all(p, head, sizeof(head)) || head[0] < sizeof(serial::cell) || head[0] % sizeof(uint64_t)) {
+				return false;
+			}
+			std::vector<uint64_t> buf(head[0] / sizeof(uint64_t));
+			if (!read_all(p, buf.data(), head[0])) {
+				return false;
+			}
+			tag = head[1];
+			o = serial::view(buf.data(), head[0]).oper();
+
+			return true;
+		}
+
+	} // namespace detail
+
+	// Serve calls on standard input and output until the connector closes them.
+	// Standard input and output are pointed at the null device so functions
+	// writing to them cannot corrupt the results. Return the exit code.
+	inline int serve()
+	{
+		detail::pipe in, out;
+		detail::take_stdio(in, out);
+		for (;;) {
+			uint64_t off;
+			OPER12 args;
+			if (!detail::recv(in, off, args)) {
+				return 0;
+			}
+			OPER12 r;
+			try {
+				r = detail::at(off)(args);
+			}
+			catch (...) {
+				r = OPER12(XlErr::Value);
+			}
+			if (!detail::send(out, 0, r)) {
+				return 0;
+			}
+		}
+	}
+
+	// Pool of worker processes on this machine. One dispatcher thread per worker
+	// sends it a call at a time and passes the result to the callback.
+	class local_connector {
+		struct job {
+			XLOPER12 handle;
+			uint64_t f;
+			OPER12 args;
+			async::token t;
+		};
+		PXL_HPC_ASYNC_CALLBACK callback;
+		std::vector<detail::process> workers;
+		std::vector<std::thread> dispatchers;
+		std::vector<char> busy, killed; // by worker
+		std::deque<job> jobs;
+		size_t pending = 0;
+		size_t restarts_ = 0;
+		bool stop = false;
+		std::mutex m, spawn_m;
+		std::condition_variable work, idle;
+
+		void spawn(size_t i)
+		{
+			std::lock_guard lock(spawn_m);
+			workers[i] = detail::spawn();
+		}
+		// Replace worker i unless the connector is stopping.
+		void restart(size_t i)
+		{
+			bool stopping;
+			{
+				std::lock_guard lock(m);
+				stopping = stop;
+			}
+			std::lock_guard lock(spawn_m);
+			detail::stop(workers[i]);
+			if (!stopping) {
+				try {
+					workers[i] = detail::spawn();
+				}
+				catch (...) {
+					// retried on the next call
+				}
+			}
+		}
+		// Send j to worker i and read the result. Return false if the worker is gone.
+		bool run(size_t i, const job& j, OPER12& r)
+		{
+			uint64_t tag;
+			try {
+				return detail::send(workers[i].in, j.f, j.args) && detail::recv(workers[i].out, tag, r);
+			}
+			catch (...) {
+				return false;
+			}
+		}
+
+		void dispatch(size_t i)
+		{
+			for (;;) {
+				job j;
+				{
+					std::unique_lock lock(m);
+					work.wait(lock, [this] { return stop || !jobs.empty(); });
+					if (jobs.empty()) {
+						return;
+					}
+					j = std::move(jobs.front());
+					jobs.pop_front();
+					busy[i] = true;
+				}
+				OPER12 r;
+				bool ok = run(i, j, r);
+				bool k;
+				{
+					std::lock_guard lock(m);
+					busy[i] = false;
+					k = killed[i];
+					killed[i] = false;
+					if (!ok && !k) {
+						++restarts_;
+					}
+				}
+				if (!ok || k) {
+					restart(i);
+				}
+				if (!ok) {
+					r = OPER12(XlErr::Value);
+				}
+				if (!k && !j.t.cancelled()) {
+					callback(&j.handle, &r);
+				}
+				{
+					std::lock_guard lock(m);
+					if (--pending == 0) {
+						idle.notify_all();
+					}
+				}
+			}
+		}
+		// Drop queued calls and kill the workers running one. Hold m.
+		void drop()
+		{
+			pending -= jobs.size();
+			jobs.clear();
+			if (pending == 0) {
+				idle.notify_all();
+			}
+			std::lock_guard lock(spawn_m);
+			for (size_t i = 0; i < workers.size(); ++i) {
+				if (busy[i]) {
+					killed[i] = true;
+					detail::kill(workers[i]);
+				}
+			}
+		}
+		// Join the dispatchers and stop the workers once stop is set.
+		void close()
+		{
+			work.notify_all();
+			for (auto& t : dispatchers) {
+				if (t.joinable()) {
+					t.join();
+				}
+			}
+			for (auto& w : workers) {
+				detail::stop(w);
+			}
+		}
+	public:
+		explicit local_connector(size_t n = std::thread::hardware_concurrency(), PXL_HPC_ASYNC_CALLBACK callback = async_return)
+			: callback(callback), workers(std::max<size_t>(n, 1)), busy(workers.size()), killed(workers.size())
+		{
+			try {
+				for (size_t i = 0; i < workers.size(); ++i) {
+					spawn(i);
+				}
+			}
+			catch (...) {
+				for (auto& w : workers) {
+					detail::stop(w);
+				}
+				throw;
+			}
+			for (size_t i = 0; i < workers.size(); ++i) {
+				dispatchers.emplace_back(&local_connector::dispatch, this, i);
+			}
+		}
+		local_connector(const local_connector&) = delete;
+		local_connector& operator=(const local_connector&) = delete;
+		// Finish queued calls then stop the workers.
+		~local_connector()
+		{
+			{
+				std::lock_guard lock(m);
+				stop = true;
+			}
+			close();
+		}
+
+		// Drop queued calls, kill running ones, and stop the workers.
+		// Call before the module unloads so no thread is joined under the loader lock.
+		void shutdown()
+		{
+			{
+				std::lock_guard lock(m);
+				stop = true;
+				drop();
+			}
+			close();
+		}
+		// Drop queued calls and kill running ones without returning results.
+		// Killed workers are replaced. Called when Excel cancels a calculation.
+		void cancel()
+		{
+			std::lock_guard lock(m);
+			drop();
+		}
+
+		size_t size() const
+		{
+			return workers.size();
+		}
+		// Workers replaced after a crash.
+		size_t restarts()
+		{
+			std::lock_guard lock(m);
+
+			return restarts_;
+		}
+
+		// Queue f(args) and pass the result to the callback with handle.
+		// Return false after shutdown.
+		bool try_submit(const XLOPER12& handle, function f, const OPER12& args)
+		{
+			uint64_t off = detail::offset(f);
+			{
+				std::lock_guard lock(m);
+				if (stop) {
+					return false;
+				}
+				jobs.push_back(job{ handle, off, args, async::token() });
+				++pending;
+			}
+			work.notify_one();
+
+			return true;
+		}
+		void submit(const XLOPER12& handle, function f, const OPER12& args)
+		{
+			bool submitted = try_submit(handle, f, args);
+			ensure(submitted);
+		}
+
+		// Block until every submitted call has completed.
+		void wait()
+		{
+			std::unique_lock lock(m);
+			idle.wait(lock, [this] { return pending == 0; });
+		}
+	};
+
+	namespace detail {
+		inline std::atomic<bool> local_started = false;
+	}
+
+	// Workers shared by all cluster-safe functions, started on first use.
+	inline local_connector& local()
+	{
+		static local_connector connector;
+		detail::local_started = true;
+
+		return connector;
+	}
+
+	// Stop the shared workers if they were started. Called by xlAutoClose.
+	inline void shutdown()
+	{
+		if (detail::local_started) {
+			local().shutdown();
+		}
+	}
+
+	// Drop and kill the calls of a cancelled calculation. Called with async::cancel.
+	inline void cancel()
+	{
+		if (detail::local_started) {
+			local().cancel();
+		}
+	}
+
+	// Run f(args) in a worker process and return the result with xlAsyncReturn.
+	// On a cluster node the call already runs remotely so it is made directly.
+	inline void call(const XLOPER12* handle, function f, const OPER12& args)
+	{
+		static const bool on_cluster = running_on_cluster();
+
+		if (on_cluster) {
+			async::call(handle, [f, args](const async::token&) { return f(args); });
+		}
+		else if (!local().try_submit(*handle, f, args)) {
+			XLOPER12 h = *handle;
+			XLOPER12 r = Err12(XlErr::Value);
+			async_return(&h, &r);
+		}
+	}
+
+#ifdef _DEBUG
+	// Run by a program whose main calls serve() when given worker_flag, e.g. test.cpp.
+	inline void test_cluster()
+	{
+		static std::mutex m;
+		static std::map<intptr_t, OPER12> results; // by handle
+		auto handle = [](intptr_t id) {
+			XLOPER12 h = { .xltype = xltypeBigData };
+			h.val.bigdata.h.hdata = reinterpret_cast<HANDLE>(id);
+			return h;
+		};
+		{
+			local_connector c(2, [](LPXLOPER12 h, LPXLOPER12 r) {
+				std::lock_guard lock(m);
+				results[reinterpret_cast<intptr_t>(h->val.bigdata.h.hdata)] = OPER12(*r);
+				return xlHpcRetSuccess;
+			});
+			ensure(c.size() == 2);
+
+			OPER12 args(1, 2);
+			args[0] = OPER12(3.);
+			args[1] = OPER12(L"a string longer than inline");
+			for (intptr_t i = 1; i <= 10; ++i) {
+				c.submit(handle(i), [](const OPER12& a) { return OPER12(a[0].val.num * a[0].val.num); }, args);
+			}
+			c.submit(handle(11), [](const OPER12& a) { return OPER12(a[1]); }, args);
+			c.submit(handle(12), [](const OPER12&) -> OPER12 { std::puts("not a result"); throw std::runtime_error("failed"); }, args);
+			c.wait();
+			ensure(results.size() == 12);
+			for (intptr_t i = 1; i <= 10; ++i) {
+				ensure(results.at(i) == 9.);
+			}
+			ensure(results.at(11) == args[1]);
+			ensure(results.at(12) == OPER12(XlErr::Value));
+
+			// a crash costs its call and the worker
+			c.submit(handle(13), [](const OPER12&) -> OPER12 { std::_Exit(1); }, args);
+			c.wait();
+			ensure(c.restarts() == 1);
+			ensure(results.at(13) == OPER12(XlErr::Value));
+			for (intptr_t i = 14; i <= 17; ++i) {
+				c.submit(handle(i), [](const OPER12& a) { return OPER12(a[0]); }, args);
+			}
+			c.wait();
+			for (intptr_t i = 14; i <= 17; ++i) {
+				ensure(results.at(i) == 3.);
+			}
+
+			// cancelled calls are dropped or killed and return nothing
+			auto hang = [](const OPER12&) -> OPER12 {
+				for (;;) {
+					std::this_thread::sleep_for(std::chrono::seconds(1));
+				}
+			};
+			for (intptr_t i = 20; i < 23; ++i) {
+				c.submit(handle(i), hang, args);
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+			async::cancel();
+			c.cancel();
+			c.wait();
+			ensure(!results.contains(20) && !results.contains(21) && !results.contains(22));
+			ensure(c.restarts() == 1);
+			c.submit(handle(23), [](const OPER12& a) { return OPER12(a[0]); }, args);
+			c.wait();
+			ensure(results.at(23) == 3.);
+
+			// shutdown does not wait for running calls
+			c.submit(handle(24), hang, args);
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+			c.shutdown();
+			ensure(!results.contains(24));
+			bool thrown = false;
+			try {
+				c.submit(handle(18), [](const OPER12& a) { return OPER12(a[0]); }, args);
+			}
+			catch (const std::exception&) {
+				thrown = true;
+			}
+			ensure(thrown);
+		}
+		results.clear();
+	}
+#endif // _DEBUG
+
+} // namespace xll::cluster
@@ -0,0 +1,274 @@
+// convert.h - convert between XLOPER and XLOPER12
+// CHAR strings are treated as Latin-1. Characters above 0xFF become '?'.
+#pragma once
+#include <algorithm>
+#include <limits>
+#include "oper.h"
+
+namespace xll {
+
+	// What was lost in a conversion.
+	struct truncation {
+		bool rows = false;       // Multi rows clamped
+		bool columns = false;    // Multi columns clamped
+		bool strings = false;    // string length clamped
+		bool characters = false; // characters replaced by '?'
+		bool values = false;     // references or types that could not be represented
+
+		explicit operator bool() const noexcept
+		{
+			return rows || columns || strings || characters || values;
+		}
+	};
+
+	namespace detail {
+
+		// Largest Multi dimensions and string length representable in Y.
+		template<is_xloper Y>
+		inline constexpr size_t rw_max = std::min<size_t>(traits<Y>::rw_max, std::numeric_limits<typename traits<Y>::xrw>::max());
+		template<is_xloper Y>
+		inline constexpr size_t col_max = std::min<size_t>(traits<Y>::col_max, std::numeric_limits<typename traits<Y>::xcol>::max());
+		template<is_xloper Y>
+		inline constexpr size_t len_max = traits<Y>::str_max - 1;
+		// Largest row and column index of a reference in Y.
+		template<is_xloper Y>
+		inline constexpr size_t rw_last = std::min<size_t>(traits<Y>::rw_max - 1, std::numeric_limits<decltype(traits<Y>::xref::rwLast)>::max());
+		template<is_xloper Y>
+		inline constexpr size_t col_last = std::min<size_t>(traits<Y>::col_max - 1, std::numeric_limits<decltype(traits<Y>::xref::colLast)>::max());
+
+		// Copy n characters widening or narrowing. Return true if any were replaced.
+		template<class T, class S>
+		inline bool convert_chars(T* t, const S* s, size_t n)
+		{
+			using U = std::make_unsigned_t<S>;
+			constexpr unsigned max = std::numeric_limits<std::make_unsigned_t<T>>::max();
+			unsigned bad = 0;
+
+			for (size_t i = 0; i < n; ++i) {
+				unsigned c = static_cast<U>(s[i]);
+				bad |= c > max;
+				t[i] = static_cast<T>(c > max ? '?' : c);
+			}
+
+			return bad != 0;
+		}
+
+		template<is_xloper Y, XlOper X>
+		inline size_t convert_len(const X& x, truncation& t)
+		{
+			size_t len = static_cast<std::make_unsigned_t<typename traits<xloper_t<X>>::xchar>>(x.val.str[0]);
+			if (len > len_max<Y>) {
+				t.strings = true;
+				len = len_max<Y>;
+			}
+
+			return len;
+		}
+
+		// Any value except Str and Multi.
+		template<is_xloper Y, is_xloper X>
+		inline Y convert_scalar(const X& x, truncation& t)
+		{
+			Y y = { .xltype = xltypeNil };
+
+			switch (type(x)) {
+			case xltypeNum:
+				y.val.num = x.val.num;
+				y.xltype = xltypeNum;
+				break;
+			case xltypeBool:
+				y.val.xbool = x.val.xbool;
+				y.xltype = xltypeBool;
+				break;
+			case xltypeErr:
+				y.val.err = x.val.err;
+				y.xltype = xltypeErr;
+				break;
+			case xltypeInt:
+				if (x.val.w >= std::numeric_limits<decltype(y.val.w)>::min()
+					&& x.val.w <= std::numeric_limits<decltype(y.val.w)>::max()) {
+					y.val.w = static_cast<decltype(y.val.w)>(x.val.w);
+					y.xltype = xltypeInt;
+				}
+				else {
+					y.val.num = x.val.w; // exact
+					y.xltype = xltypeNum;
+				}
+				break;
+			case xltypeSRef: {
+				const auto& r = x.val.sref.ref;
+				if (static_cast<size_t>(r.rwLast) <= rw_last<Y> && static_cast<size_t>(r.colLast) <= col_last<Y>) {
+					y.val.sref.count = 1;
+					y.val.sref.ref.rwFirst = static_cast<decltype(y.val.sref.ref.rwFirst)>(r.rwFirst);
+					y.val.sref.ref.rwLast = static_cast<decltype(y.val.sref.ref.rwLast)>(r.rwLast);
+					y.val.sref.ref.colFirst = static_cast<decltype(y.val.sref.ref.colFirst)>(r.colFirst);
+					y.val.sref.ref.colLast = static_cast<decltype(y.val.sref.ref.colLast)>(r.colLast);
+					y.xltype = xltypeSRef;
+				}
+				else {
+					y.val.err = xlerrRef;
+					y.xltype = xltypeErr;
+					t.values = true;
+				}
+				break;
+			}
+			case xltypeMissing:
+				y.xltype = xltypeMissing;
+				break;
+			case xltypeNil:
+				break;
+			default:
+				y.val.err = xlerrValue;
+				y.xltype = xltypeErr;
+				t.values = true;
+			}
+
+			return y;
+		}
+
+	} // namespace detail
+
+	// Convert x to Y in a single allocation. Multi dimensions are clamped to what Y can hold.
+	template<is_xloper Y, XlOper X>
+	inline XOPER<Y> convert(const X& x, truncation* pt = nullptr,
+		std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+	{
+		using xchar = traits<Y>::xchar;
+		truncation t;
+		XOPER<Y> o;
+
+		if (type(x) == xltypeStr) {
+			size_t len = detail::convert_len<Y>(x, t);
+			xchar* s = o.str_alloc(len, mr);
+			t.characters = detail::convert_chars(s + 1, x.val.str + 1, len);
+		}
+		else if (type(x) == xltypeMulti) {
+			size_t r = static_cast<size_t>(x.val.array.rows);
+			size_t c = static_cast<size_t>(x.val.array.columns);
+			size_t r_ = std::min(r, detail::rw_max<Y>);
+			size_t c_ = std::min(c, detail::col_max<Y>);
+			t.rows = r_ < r;
+			t.columns = c_ < c;
+
+			const X* a = (const X*)x.val.array.lparray;
+			size_t extra = 0;
+			for (size_t i = 0; i < r_; ++i) {
+				for (size_t j = 0; j < c_; ++j) {
+					const X& aij = a[i * c + j];
+					if (type(aij) == xltypeStr) {
+						extra += XOPER<Y>::str_bytes(detail::convert_len<Y>(aij, t));
+					}
+				}
+			}
+
+			o = XOPER<Y>(static_cast<typename traits<Y>::xrw>(r_), static_cast<typename traits<Y>::xcol>(c_), extra, mr);
+			for (size_t i = 0; i < r_; ++i) {
+				for (size_t j = 0; j < c_; ++j) {
+					const X& aij = a[i * c + j];
+					size_t k = i * c_ + j;
+					if (type(aij) == xltypeStr) {
+						size_t len = detail::convert_len<Y>(aij, t);
+						xchar* s = o.set_str(k, len);
+						t.characters |= detail::convert_chars(s + 1, aij.val.str + 1, len);
+					}
+					else {
+						o.set(k, detail::convert_scalar<Y>(static_cast<const xloper_t<X>&>(aij), t));
+					}
+				}
+			}
+		}
+		else {
+			o = XOPER<Y>(detail::convert_scalar<Y>(static_cast<const xloper_t<X>&>(x), t), mr);
+		}
+
+		if (pt) {
+			*pt = t;
+		}
+
+		return o;
+	}
+	template<XlOper X>
+	inline OPER4 to_oper4(const X& x, truncation* pt = nullptr)
+	{
+		return convert<XLOPER>(x, pt);
+	}
+	template<XlOper X>
+	inline OPER12 to_oper12(const X& x, truncation* pt = nullptr)
+	{
+		return convert<XLOPER12>(x, pt);
+	}
+
+#ifdef _DEBUG
+	inline void test_convert()
+	{
+		{
+			truncation t;
+			OPER4 o = to_oper4(OPER12(1.5), &t);
+			ensure(!t);
+			ensure(o.xltype == xltypeNum);
+			ensure(o.val.num == 1.5);
+			o = to_oper4(OPER12(100000), &t);
+			ensure(!t);
+			ensure(o.xltype == xltypeNum);
+			ensure(o.val.num == 100000);
+			OPER12 o12 = to_oper12(o, &t);
+			ensure(o12.val.num == 100000);
+		}
+		{
+			truncation t;
+			XCHAR s[] = { 'a', 0xE9, 0x20AC };
+			OPER12 str(3, s);
+			OPER4 o = to_oper4(str, &t);
+			ensure(t.characters);
+			ensure(o.val.str[0] == 3);
+			ensure((unsigned char)o.val.str[2] == 0xE9);
+			ensure(o.val.str[3] == '?');
+			OPER12 o12 = to_oper12(o, &t);
+			ensure(!t);
+			ensure(o12.val.str[2] == 0xE9);
+		}
+		{
+			truncation t;
+			OPER12 m(1, 300);
+			m[0] = OPER12(L"a string longer than inline");
+			m[1] = OPER12(true);
+			m[299] = OPER12(2.);
+			OPER4 o = to_oper4(m, &t);
+			ensure(t.columns);
+			ensure(!t.rows);
+			ensure(o.val.array.columns == 256);
+			ensure(o[0] == "a string longer than inline");
+			ensure(xblock::owner(o[0].val.str) == nullptr);
+			ensure(o[1] == true);
+			OPER12 o12 = to_oper12(o, &t);
+			ensure(!t);
+			ensure(o12[0] == m[0]);
+		}
+		{
+			truncation t;
+			OPER12 s(std::wstring(300, L'x').c_str());
+			OPER4 o = to_oper4(s, &t);
+			ensure(t.strings);
+			ensure((unsigned char)o.val.str[0] == 255);
+		}
+		{
+			static_assert(detail::rw_last<XLOPER> == 0xFFFF && detail::col_last<XLOPER> == 0xFF);
+			static_assert(detail::rw_last<XLOPER12> == 0xFFFFF && detail::col_last<XLOPER12> == 0x3FFF);
+			truncation t;
+			OPER12 r(XLOPER12{ .val = {.sref = {.count = 1, .ref = REF(0, 0, 0x10000, 0x100)}}, .xltype = xltypeSRef });
+			OPER4 o = to_oper4(r, &t);
+			ensure(!t);
+			ensure(o.xltype == xltypeSRef);
+			ensure(o.val.sref.ref.rwLast == 0xFFFF && o.val.sref.ref.colLast == 0xFF);
+			r.val.sref.ref.rwLast = 0x10000;
+			ensure(to_oper4(r, &t).xltype == xltypeErr);
+			ensure(t.values);
+			t = truncation{};
+			r.val.sref.ref.rwLast = 0xFFFF;
+			r.val.sref.ref.colLast = 0x100;
+			ensure(to_oper4(r, &t).xltype == xltypeErr);
+		}
+	}
+#endif // _DEBUG
+
+} // namespace xll
@@ -2,23 +2,47 @@
 // Copyright (c) KALX, LLC. All rights reserved. No warranty made.
 #pragma once
 #include <array>
+#include <concepts>
+#include <thread>
 #include <utility>
+#include <vector>
 #include "oper.h"
+#ifdef _DEBUG
+#include "host.h"
+#endif
 
 namespace xll {
 
+	namespace detail {
+
+		// Call Excel with result in o. Memory Excel allocated is marked for xlFree.
+		template<is_xloper X>
+		inline int Excelv(XOPER<X>& o, int xlfn, int n, X* opers[])
+		{
+			int ret = traits<X>::Excelv(xlfn, &o, n, opers);
+			if (type(o) & (xltypeStr | xltypeMulti | xltypeRef)) {
+				if (ret == xlretSuccess) {
+					o.xltype |= xlbitXLFree;
+				}
+				else {
+					o.xltype = xltypeNil; // not ours to free
+				}
+			}
+
+			return ret;
+		}
+
+	} // namespace detail
+
 	template<typename X>
 	inline XOPER<X> Excelv(int xlfn, unsigned n, X* opers[])
 	{
 		XOPER<X> o;
 
-		int ret = traits<X>::Excelv(xlfn, &o, static_cast<int>(n), &opers[0]);
+		int ret = detail::Excelv(o, xlfn, static_cast<int>(n), &opers[0]);
 		if (ret != xlretSuccess) {
 			ensure(o.xltype == xltypeErr);
 		}
-		else if (!o.is_scalar()) {
-			o.xltype |= xlbitXLFree;
-		}
 
 		return o;
 	}
@@ -47,4 +71,214 @@ namespace xll {
 		return XExcel<XLOPERX, Args...>(fn, args...);
 	}
 
-} // namespace xll
\ No newline at end of file
+	// Result slot reused across callbacks, e.g. xlCoerce in a loop.
+	// The previous result is released in place before each call and
+	// arguments are passed in a fixed size array on the stack.
+	template<is_xloper X>
+	class XCall {
+		XOPER<X> o;
+		int ret;
+	public:
+		XCall()
+			: ret(xlretSuccess)
+		{ }
+		XCall(const XCall&) = delete;
+		XCall& operator=(const XCall&) = delete;
+
+		// Result is valid until the next call.
+		template<class... Args>
+			requires (std::convertible_to<const Args*, const X*> && ...)
+		const XOPER<X>& operator()(int xlfn, const Args&... args)
+		{
+			static_assert(sizeof...(Args) <= traits<X>::arg_max);
+			X* xargs[sizeof...(Args) + 1] = { const_cast<X*>(static_cast<const X*>(&args))... };
+
+			o.reset();
+			ret = detail::Excelv(o, xlfn, static_cast<int>(sizeof...(Args)), xargs);
+
+			return o;
+		}
+
+		// Return code of the last call.
+		int status() const
+		{
+			return ret;
+		}
+		const XOPER<X>& result() const
+		{
+			return o;
+		}
+	};
+	using Call4 = XCall<XLOPER>;
+	using Call12 = XCall<XLOPER12>;
+	using Call = XCall<XLOPERX>;
+
+	// Per-thread state so functions registered as thread-safe ($) can
+	// return values and make callbacks without sharing anything.
+	template<is_xloper X>
+	struct XContext {
+		XOPER<X> result; // returned to Excel
+		XCall<X> call;   // callbacks with a reused result
+
+		// Context of the calling thread.
+		static XContext& get()
+		{
+			thread_local XContext context;
+
+			return context;
+		}
+
+		// Keep o in this thread's result and return it to Excel.
+		X* ret(XOPER<X>&& o)
+		{
+			result = std::move(o);
+
+			return &result;
+		}
+	};
+	using Context4 = XContext<XLOPER>;
+	using Context12 = XContext<XLOPER12>;
+	using Context = XContext<XLOPERX>;
+
+#ifdef XLL_INSTRUMENT
+	// Callbacks made by this add-in. Columns are xlfn, count, mean, 50% and 99%
+	// latency in seconds, and number of calls not returning xlretSuccess.
+	inline OPER12 callback_stats()
+	{
+		auto v = instrument::snapshot();
+		OPER12 o(static_cast<INT32>(v.size() + 1), 6);
+
+		const XCHAR* head[] = { L"xlfn", L"count", L"mean", L"p50", L"p99", L"failed" };
+		for (int j = 0; j < 6; ++j) {
+			o(0, j) = OPER12(head[j]);
+		}
+		for (int i = 0; i < static_cast<int>(v.size()); ++i) {
+			const auto& s = v[i];
+			o(i + 1, 0) = OPER12(s.xlfn);
+			o(i + 1, 1) = OPER12(static_cast<double>(s.count));
+			o(i + 1, 2) = OPER12(s.mean());
+			o(i + 1, 3) = OPER12(s.quantile(0.5));
+			o(i + 1, 4) = OPER12(s.quantile(0.99));
+			o(i + 1, 5) = OPER12(static_cast<double>(s.failed()));
+		}
+
+		return o;
+	}
+#endif // XLL_INSTRUMENT
+
+#ifdef _DEBUG
+	inline void test_excel()
+	{
+		static_assert(std::invocable<Call12&, int, OPER12, XLOPER12>);
+		static_assert(!std::invocable<Call12&, int, OPER4>);
+		static_assert(!std::invocable<Call12&, int, double>);
+		{
+			OPER12 o(L"a string longer than inline");
+			o.reset();
+			ensure(o.xltype == xltypeNil);
+			o.reset();
+			ensure(o.xltype == xltypeNil);
+		}
+		{
+			Context12& c = Context12::get();
+			ensure(&c == &Context12::get());
+			Context12* other = nullptr;
+			std::thread([&other] { other = &Context12::get(); }).join();
+			ensure(other != &c);
+			XLOPER12* r = c.ret(OPER12(1.5));
+			ensure(r == &c.result);
+			ensure(r->val.num == 1.5);
+		}
+		{
+			host h;
+			h.install();
+			h.sheet[{0, 0}] = OPER12(L"a string longer than inline");
+			h.sheet[{0, 1}] = OPER12(L"2.5");
+			OPER12 ref(XLOPER12{ .val = {.sref = {.count = 1, .ref = REF(0, 0)}}, .xltype = xltypeSRef });
+
+			Call12 call;
+			const OPER12& s = call(xlCoerce, ref);
+			ensure(call.status() == xlretSuccess);
+			ensure(s.xltype == (xltypeStr | xlbitXLFree));
+			ensure(s == OPER12(L"a string longer than inline"));
+			ensure(h.outstanding() == 1);
+
+			// previous result is freed before the slot is refilled
+			ref.val.sref.ref = REF(0, 1);
+			ensure(&call(xlCoerce, ref) == &s);
+			ensure(h.outstanding() == 1);
+			ensure(s == OPER12(L"2.5"));
+
+			OPER12 types(xltypeNum);
+			ensure(call(xlCoerce, ref, types) == OPER12(2.5));
+			ensure(h.outstanding() == 0);
+			call(xlCoerce, ref);
+			ensure(h.outstanding() == 1);
+			call(xlfEvaluate, ref);
+			ensure(call.status() == xlretInvXlfn);
+			ensure(h.outstanding() == 0);
+			ensure(type(call.result()) == xltypeNil);
+		}
+	}
+	// Thread-safe functions make callbacks from recalculation threads through
+	// their own context. Build with -fsanitize=thread to check for races.
+	inline void test_context()
+	{
+		host h;
+		h.install();
+		const size_t threads = 8, n = 1000;
+		size_t calls = h.callbacks;
+		std::vector<std::thread> ts;
+		std::vector<size_t> ok(threads);
+		for (size_t t = 0; t < threads; ++t) {
+			ts.emplace_back([&ok, t] {
+				Context12& c = Context12::get();
+				for (size_t i = 0; i < n; ++i) {
+					const OPER12& a = c.call(xlAbort);
+					if (c.call.status() == xlretSuccess && type(a) == xltypeBool && !a.val.xbool) {
+						++ok[t];
+					}
+				}
+			});
+		}
+		for (auto& t : ts) {
+			t.join();
+		}
+		for (size_t k : ok) {
+			ensure(k == n);
+		}
+		ensure(h.callbacks == calls + threads * n);
+	}
+	// Excel owned results destroyed in a free_scope are released in batches.
+	inline void test_free_scope()
+	{
+		host h;
+		h.install();
+		h.sheet[{0, 0}] = OPER12(L"a string longer than inline");
+		OPER12 ref(XLOPER12{ .val = {.sref = {.count = 1, .ref = REF(0, 0)}}, .xltype = xltypeSRef });
+		const int n = traits<XLOPER12>::arg_max + 10;
+		{
+			free_scope12 s;
+			{
+				std::vector<OPER12> v;
+				v.reserve(n);
+				for (int i = 0; i < n; ++i) {
+					v.push_back(Excel12(xlCoerce, ref));
+					ensure(v.back().xltype & xlbitXLFree);
+				}
+				ensure(h.outstanding() == n);
+				size_t calls = h.callbacks;
+				v.clear();
+				ensure(s.size() == 10);
+				ensure(h.callbacks == calls + 1); // one full batch
+				ensure(h.outstanding() == 10);
+			}
+			size_t calls = h.callbacks;
+			ensure(s.flush() == 1);
+			ensure(h.callbacks == calls + 1);
+		}
+		ensure(h.outstanding() == 0);
+	}
+#endif // _DEBUG
+
+} // namespace xll
@@ -0,0 +1,481 @@
+// fp.h - two dimensional arrays of doubles
+// FP12 is the cheapest way to pass numeric ranges to and from Excel.
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <span>
+#include <utility>
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+#include "ensure.h"
+#include "stride.h"
+#include "xltraits.h"
+
+namespace xll {
+
+	// Non-owning view of a row-major array of doubles.
+	template<class T = double>
+	class fp_view {
+		T* a;
+		INT32 r, c;
+	public:
+		using value_type = std::remove_cv_t<T>;
+
+		constexpr fp_view(T* a = nullptr, INT32 r = 0, INT32 c = 0) noexcept
+			: a(a), r(r), c(c)
+		{ }
+		fp_view(FP12& fp) noexcept
+			: fp_view(fp.array, fp.rows, fp.columns)
+		{ }
+		fp_view(const FP12& fp) noexcept requires std::is_const_v<T>
+			: fp_view(fp.array, fp.rows, fp.columns)
+		{ }
+		// Views of double are views of const double.
+		constexpr operator fp_view<const double>() const noexcept
+		{
+			return fp_view<const double>(a, r, c);
+		}
+
+		constexpr INT32 rows() const noexcept
+		{
+			return r;
+		}
+		constexpr INT32 columns() const noexcept
+		{
+			return c;
+		}
+		constexpr std::size_t size() const noexcept
+		{
+			return static_cast<std::size_t>(r) * c;
+		}
+		constexpr T* data() const noexcept
+		{
+			return a;
+		}
+		constexpr T* begin() const noexcept
+		{
+			return a;
+		}
+		constexpr T* end() const noexcept
+		{
+			return a + size();
+		}
+
+		constexpr T& operator[](std::size_t i) const noexcept
+		{
+			return a[i];
+		}
+		constexpr T& operator()(INT32 i, INT32 j) const noexcept
+		{
+			return a[static_cast<std::size_t>(i) * c + j];
+		}
+
+		constexpr std::span<T> row(INT32 i) const noexcept
+		{
+			return std::span<T>(a + static_cast<std::size_t>(i) * c, c);
+		}
+		constexpr stride_span<T> column(INT32 j) const noexcept
+		{
+			return stride_span<T>(a + j, r, c);
+		}
+	};
+	fp_view(FP12&) -> fp_view<double>;
+	fp_view(const FP12&) -> fp_view<const double>;
+
+	// Owning FP12 that can be returned to Excel.
+	class FPX {
+		FP12* fp;
+		std::size_t cap; // capacity in doubles or 0 if fp is empty_
+
+		// Shared 0 x 0 array of moved-from objects. Never written.
+		static inline FP12 empty_ = { .rows = 0, .columns = 0, .array = { 0 } };
+
+		static FP12* alloc(std::size_t n)
+		{
+			FP12* p = static_cast<FP12*>(::operator new(offsetof(FP12, array) + std::max<std::size_t>(n, 1) * sizeof(double)));
+			p->rows = 0;
+			p->columns = 0;
+
+			return p;
+		}
+	public:
+		FPX(INT32 r = 0, INT32 c = 0)
+			: fp(&empty_), cap(0)
+		{
+			resize(r, c);
+		}
+		FPX(const FP12& a)
+			: FPX(a.rows, a.columns)
+		{
+			std::copy(a.array, a.array + size(), fp->array);
+		}
+		FPX(const FPX& a)
+			: FPX(*a.fp)
+		{ }
+		FPX& operator=(const FPX& a)
+		{
+			if (this != &a) {
+				resize(a.rows(), a.columns());
+				std::copy(a.begin(), a.end(), begin());
+			}
+
+			return *this;
+		}
+		// Leaves a as a 0 x 0 array.
+		FPX(FPX&& a) noexcept
+			: fp(std::exchange(a.fp, &empty_)), cap(std::exchange(a.cap, 0))
+		{ }
+		FPX& operator=(FPX&& a) noexcept
+		{
+			std::swap(fp, a.fp);
+			std::swap(cap, a.cap);
+
+			return *this;
+		}
+		~FPX()
+		{
+			if (cap) {
+				::operator delete(fp);
+			}
+		}
+
+		// Pointer to pass to Excel.
+		FP12* get() noexcept
+		{
+			return fp;
+		}
+		const FP12* get() const noexcept
+		{
+			return fp;
+		}
+
+		// Reallocate only if r x c exceeds capacity.
+		FPX& resize(INT32 r, INT32 c)
+		{
+			ensure(r >= 0 && static_cast<std::size_t>(r) <= traits<XLOPER12>::rw_max);
+			ensure(c >= 0 && static_cast<std::size_t>(c) <= traits<XLOPER12>::col_max);
+
+			std::size_t n = static_cast<std::size_t>(r) * c;
+			if (!cap || n > cap) {
+				FP12* p = alloc(n);
+				if (cap) {
+					std::copy(fp->array, fp->array + size(), p->array);
+					::operator delete(fp);
+				}
+				fp = p;
+				cap = std::max<std::size_t>(n, 1);
+			}
+			fp->rows = r;
+			fp->columns = c;
+
+			return *this;
+		}
+
+		INT32 rows() const noexcept
+		{
+			return fp->rows;
+		}
+		INT32 columns() const noexcept
+		{
+			return fp->columns;
+		}
+		std::size_t size() const noexcept
+		{
+			return static_cast<std::size_t>(fp->rows) * fp->columns;
+		}
+		double* data() noexcept
+		{
+			return fp->array;
+		}
+		const double* data() const noexcept
+		{
+			return fp->array;
+		}
+		double* begin() noexcept
+		{
+			return fp->array;
+		}
+		const double* begin() const noexcept
+		{
+			return fp->array;
+		}
+		double* end() noexcept
+		{
+			return fp->array + size();
+		}
+		const double* end() const noexcept
+		{
+			return fp->array + size();
+		}
+
+		double& operator[](std::size_t i) noexcept
+		{
+			return fp->array[i];
+		}
+		const double& operator[](std::size_t i) const noexcept
+		{
+			return fp->array[i];
+		}
+		double& operator()(INT32 i, INT32 j) noexcept
+		{
+			return view()(i, j);
+		}
+		const double& operator()(INT32 i, INT32 j) const noexcept
+		{
+			return view()(i, j);
+		}
+
+		fp_view<double> view() noexcept
+		{
+			return fp_view<double>(fp->array, fp->rows, fp->columns);
+		}
+		fp_view<const double> view() const noexcept
+		{
+			return fp_view<const double>(fp->array, fp->rows, fp->columns);
+		}
+		std::span<double> row(INT32 i) noexcept
+		{
+			return view().row(i);
+		}
+		stride_span<double> column(INT32 j) noexcept
+		{
+			return view().column(j);
+		}
+	};
+
+	// Kernels on contiguous doubles.
+	// Reductions use several accumulators so results can differ from a
+	// sequential loop in the last bits.
+	namespace fp {
+
+		// z = x + y
+		inline void add(std::size_t n, const double* x, const double* y, double* z) noexcept
+		{
+			std::size_t i = 0;
+#if defined(__AVX__)
+			for (; i + 4 <= n; i += 4) {
+				_mm256_storeu_pd(z + i, _mm256_add_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+			}
+#endif
+			for (; i < n; ++i) {
+				z[i] = x[i] + y[i];
+			}
+		}
+
+		// y = a * x
+		inline void scale(std::size_t n, double a, const double* x, double* y) noexcept
+		{
+			std::size_t i = 0;
+#if defined(__AVX__)
+			__m256d a_ = _mm256_set1_pd(a);
+			for (; i + 4 <= n; i += 4) {
+				_mm256_storeu_pd(y + i, _mm256_mul_pd(a_, _mm256_loadu_pd(x + i)));
+			}
+#endif
+			for (; i < n; ++i) {
+				y[i] = a * x[i];
+			}
+		}
+
+		inline double sum(std::size_t n, const double* x) noexcept
+		{
+			std::size_t i = 0;
+			double s[4] = { 0, 0, 0, 0 };
+#if defined(__AVX__)
+			__m256d s0 = _mm256_setzero_pd();
+			__m256d s1 = _mm256_setzero_pd();
+			for (; i + 8 <= n; i += 8) {
+				s0 = _mm256_add_pd(s0, _mm256_loadu_pd(x + i));
+				s1 = _mm256_add_pd(s1, _mm256_loadu_pd(x + i + 4));
+			}
+			_mm256_storeu_pd(s, _mm256_add_pd(s0, s1));
+#endif
+			for (; i + 4 <= n; i += 4) {
+				s[0] += x[i];
+				s[1] += x[i + 1];
+				s[2] += x[i + 2];
+				s[3] += x[i + 3];
+			}
+			for (; i < n; ++i) {
+				s[0] += x[i];
+			}
+
+			return (s[0] + s[1]) + (s[2] + s[3]);
+		}
+
+		inline double dot(std::size_t n, const double* x, const double* y) noexcept
+		{
+			std::size_t i = 0;
+			double s[4] = { 0, 0, 0, 0 };
+#if defined(__AVX__)
+			__m256d s0 = _mm256_setzero_pd();
+			__m256d s1 = _mm256_setzero_pd();
+			for (; i + 8 <= n; i += 8) {
+				s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+				s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+			}
+			_mm256_storeu_pd(s, _mm256_add_pd(s0, s1));
+#endif
+			for (; i + 4 <= n; i += 4) {
+				s[0] += x[i] * y[i];
+				s[1] += x[i + 1] * y[i + 1];
+				s[2] += x[i + 2] * y[i + 2];
+				s[3] += x[i + 3] * y[i + 3];
+			}
+			for (; i < n; ++i) {
+				s[0] += x[i] * y[i];
+			}
+
+			return (s[0] + s[1]) + (s[2] + s[3]);
+		}
+
+		// Smallest element or +infinity if empty. NaNs are not propagated.
+		inline double min(std::size_t n, const double* x) noexcept
+		{
+			std::size_t i = 0;
+			constexpr double inf = std::numeric_limits<double>::infinity();
+			double m[4] = { inf, inf, inf, inf };
+#if defined(__AVX__)
+			__m256d m_ = _mm256_set1_pd(inf);
+			for (; i + 4 <= n; i += 4) {
+				m_ = _mm256_min_pd(_mm256_loadu_pd(x + i), m_);
+			}
+			_mm256_storeu_pd(m, m_);
+#endif
+			for (; i + 4 <= n; i += 4) {
+				m[0] = x[i] < m[0] ? x[i] : m[0];
+				m[1] = x[i + 1] < m[1] ? x[i + 1] : m[1];
+				m[2] = x[i + 2] < m[2] ? x[i + 2] : m[2];
+				m[3] = x[i + 3] < m[3] ? x[i + 3] : m[3];
+			}
+			for (; i < n; ++i) {
+				m[0] = x[i] < m[0] ? x[i] : m[0];
+			}
+
+			return std::min(std::min(m[0], m[1]), std::min(m[2], m[3]));
+		}
+
+		// Largest element or -infinity if empty. NaNs are not propagated.
+		inline double max(std::size_t n, const double* x) noexcept
+		{
+			std::size_t i = 0;
+			constexpr double inf = std::numeric_limits<double>::infinity();
+			double m[4] = { -inf, -inf, -inf, -inf };
+#if defined(__AVX__)
+			__m256d m_ = _mm256_set1_pd(-inf);
+			for (; i + 4 <= n; i += 4) {
+				m_ = _mm256_max_pd(_mm256_loadu_pd(x + i), m_);
+			}
+			_mm256_storeu_pd(m, m_);
+#endif
+			for (; i + 4 <= n; i += 4) {
+				m[0] = x[i] > m[0] ? x[i] : m[0];
+				m[1] = x[i + 1] > m[1] ? x[i + 1] : m[1];
+				m[2] = x[i + 2] > m[2] ? x[i + 2] : m[2];
+				m[3] = x[i + 3] > m[3] ? x[i + 3] : m[3];
+			}
+			for (; i < n; ++i) {
+				m[0] = x[i] > m[0] ? x[i] : m[0];
+			}
+
+			return std::max(std::max(m[0], m[1]), std::max(m[2], m[3]));
+		}
+
+		// View overloads
+		inline void add(fp_view<const double> x, fp_view<const double> y, fp_view<double> z)
+		{
+			ensure(x.size() == y.size() && x.size() == z.size());
+
+			add(x.size(), x.data(), y.data(), z.data());
+		}
+		inline void scale(double a, fp_view<const double> x, fp_view<double> y)
+		{
+			ensure(x.size() == y.size());
+
+			scale(x.size(), a, x.data(), y.data());
+		}
+		inline double sum(fp_view<const double> x) noexcept
+		{
+			return sum(x.size(), x.data());
+		}
+		inline double dot(fp_view<const double> x, fp_view<const double> y)
+		{
+			ensure(x.size() == y.size());
+
+			return dot(x.size(), x.data(), y.data());
+		}
+		inline double min(fp_view<const double> x) noexcept
+		{
+			return min(x.size(), x.data());
+		}
+		inline double max(fp_view<const double> x) noexcept
+		{
+			return max(x.size(), x.data());
+		}
+
+	} // namespace fp
+
+#ifdef _DEBUG
+	inline void test_fp()
+	{
+		{
+			FPX a(3, 5);
+			ensure(a.rows() == 3);
+			ensure(a.columns() == 5);
+			for (std::size_t i = 0; i < a.size(); ++i) {
+				a[i] = static_cast<double>(i);
+			}
+			ensure(a(1, 2) == 7);
+			ensure(a.row(2)[1] == 11);
+			ensure(a.column(3)[2] == 13);
+			ensure(a.column(3).size() == 3);
+
+			FPX b(a);
+			ensure(std::equal(a.begin(), a.end(), b.begin()));
+			b.resize(5, 3);
+			ensure(b(4, 2) == 14);
+			b.resize(1, 2);
+			ensure(b.get()->columns == 2);
+
+			fp_view v(*a.get());
+			ensure(v(2, 4) == 14);
+		}
+		{
+			FPX a(2, 3);
+			a(1, 2) = 5;
+			FPX b(std::move(a));
+			ensure(b(1, 2) == 5);
+			ensure(a.rows() == 0 && a.columns() == 0 && a.size() == 0);
+			ensure(a.begin() == a.end());
+			FPX c(a);
+			ensure(c.size() == 0);
+			a = b;
+			ensure(a(1, 2) == 5);
+			FPX d(std::move(b));
+			b.resize(0, 4);
+			ensure(b.columns() == 4);
+			ensure(FPX().rows() == 0);
+		}
+		{
+			FPX a(1, 13), b(1, 13), c(1, 13);
+			for (std::size_t i = 0; i < a.size(); ++i) {
+				a[i] = static_cast<double>(i) - 6;
+				b[i] = 1;
+			}
+			ensure(fp::sum(a.view()) == 0);
+			ensure(fp::dot(a.view(), b.view()) == 0);
+			ensure(fp::min(a.view()) == -6);
+			ensure(fp::max(a.view()) == 6);
+			fp::add(a.view(), b.view(), c.view());
+			ensure(c[12] == 7);
+			fp::scale(2, c.view(), c.view());
+			ensure(c[0] == -10);
+			ensure(fp::min(0, a.data()) == std::numeric_limits<double>::infinity());
+		}
+	}
+#endif // _DEBUG
+
+} // namespace xll
@@ -0,0 +1,304 @@
+// hash.h - stable hash of XLOPER values and interning
+// XXH64 https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+#pragma once
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory_resource>
+#include <unordered_set>
+#include "oper.h"
+
+namespace xll {
+
+	namespace xxh64 {
+
+		inline constexpr uint64_t P1 = 11400714785074694791ull;
+		inline constexpr uint64_t P2 = 14029467366897019727ull;
+		inline constexpr uint64_t P3 = 1609587929392839161ull;
+		inline constexpr uint64_t P4 = 9650029242287828579ull;
+		inline constexpr uint64_t P5 = 2870177450012600261ull;
+
+		inline uint64_t read64(const unsigned char* p)
+		{
+			uint64_t u;
+			std::memcpy(&u, p, 8);
+
+			return u;
+		}
+		inline uint32_t read32(const unsigned char* p)
+		{
+			uint32_t u;
+			std::memcpy(&u, p, 4);
+
+			return u;
+		}
+		inline constexpr uint64_t round(uint64_t acc, uint64_t input)
+		{
+			return std::rotl(acc + input * P2, 31) * P1;
+		}
+		inline constexpr uint64_t merge(uint64_t acc, uint64_t v)
+		{
+			return (acc ^ round(0, v)) * P1 + P4;
+		}
+		inline constexpr uint64_t avalanche(uint64_t h)
+		{
+			h ^= h >> 33;
+			h *= P2;
+			h ^= h >> 29;
+			h *= P3;
+			h ^= h >> 32;
+
+			return h;
+		}
+
+		// Four independent lanes of 64-bit words followed by a tail.
+		// next(i) returns word i so callers need not materialize the input.
+		template<class F>
+		inline uint64_t words(size_t n, size_t len, uint64_t seed, F&& next)
+		{
+			uint64_t h;
+			size_t i = 0;
+
+			if (n >= 4) {
+				uint64_t v[4] = { seed + P1 + P2, seed + P2, seed, seed - P1 };
+				for (; i + 4 <= n; i += 4) {
+					v[0] = round(v[0], next(i));
+					v[1] = round(v[1], next(i + 1));
+					v[2] = round(v[2], next(i + 2));
+					v[3] = round(v[3], next(i + 3));
+				}
+				h = std::rotl(v[0], 1) + std::rotl(v[1], 7) + std::rotl(v[2], 12) + std::rotl(v[3], 18);
+				h = merge(merge(merge(merge(h, v[0]), v[1]), v[2]), v[3]);
+			}
+			else {
+				h = seed + P5;
+			}
+			h += len;
+			for (; i < n; ++i) {
+				h ^= round(0, next(i));
+				h = std::rotl(h, 27) * P1 + P4;
+			}
+
+			return h;
+		}
+
+		// XXH64 of n bytes.
+		inline uint64_t hash(const void* p_, size_t len, uint64_t seed = 0)
+		{
+			const unsigned char* p = static_cast<const unsigned char*>(p_);
+			size_t n = len / 32 * 4; // whole stripes
+			uint64_t h = words(n, len, seed, [p](size_t i) { return read64(p + 8 * i); });
+
+			p += 8 * n;
+			len -= 8 * n;
+			for (; len >= 8; len -= 8, p += 8) {
+				h ^= round(0, read64(p));
+				h = std::rotl(h, 27) * P1 + P4;
+			}
+			if (len >= 4) {
+				h ^= read32(p) * P1;
+				h = std::rotl(h, 23) * P2 + P3;
+				len -= 4;
+				p += 4;
+			}
+			for (; len; --len, ++p) {
+				h ^= *p * P5;
+				h = std::rotl(h, 11) * P1;
+			}
+
+			return avalanche(h);
+		}
+
+	} // namespace xxh64
+
+	// Stable hash consistent with operator==.
+	template<XlOper X>
+	inline uint64_t hash(const X& x, uint64_t seed = 0)
+	{
+		uint64_t t = type(x);
+
+		switch (t) {
+		case xltypeNum: {
+			double num = x.val.num == 0 ? 0. : x.val.num; // -0 == 0
+			return xxh64::hash(&num, sizeof(num), seed ^ t);
+		}
+		case xltypeStr:
+			return xxh64::hash(x.val.str + 1, str_count(x) * sizeof(x.val.str[0]), seed ^ t);
+		case xltypeBool: {
+			uint64_t b = x.val.xbool != 0;
+			return xxh64::hash(&b, sizeof(b), seed ^ t);
+		}
+		case xltypeErr: {
+			int64_t e = x.val.err;
+			return xxh64::hash(&e, sizeof(e), seed ^ t);
+		}
+		case xltypeMulti: {
+			const X* a = (const X*)x.val.array.lparray;
+			size_t n = (size_t)x.val.array.rows * x.val.array.columns;
+			uint64_t s = seed ^ t ^ (uint64_t(x.val.array.rows) << 32) ^ uint64_t(x.val.array.columns);
+			return xxh64::avalanche(xxh64::words(n, 8 * n, s, [a](size_t i) { return hash(a[i]); }));
+		}
+		case xltypeSRef: {
+			int64_t r[4] = { x.val.sref.ref.rwFirst, x.val.sref.ref.rwLast, x.val.sref.ref.colFirst, x.val.sref.ref.colLast };
+			return xxh64::hash(r, sizeof(r), seed ^ t);
+		}
+		case xltypeInt: {
+			int64_t w = x.val.w;
+			return xxh64::hash(&w, sizeof(w), seed ^ t);
+		}
+		}
+
+		return xxh64::hash(nullptr, 0, seed ^ t); // Missing, Nil
+	}
+
+	template<XlOper X>
+	struct xloper_hash {
+		size_t operator()(const X& x) const
+		{
+			return static_cast<size_t>(hash(x));
+		}
+	};
+	template<XlOper X>
+	struct xloper_equal {
+		bool operator()(const X& x, const X& y) const
+		{
+			return x == y;
+		}
+	};
+
+	// Canonical copies of strings and scalars.
+	// Strings are owned by the pool and values it returns must not outlive it.
+	template<is_xloper X>
+	class intern_pool {
+		using xchar = traits<X>::xchar;
+		std::pmr::monotonic_buffer_resource arena;
+		std::unordered_set<X, xloper_hash<X>, xloper_equal<X>> pool;
+	public:
+		intern_pool() = default;
+		intern_pool(const intern_pool&) = delete;
+		intern_pool& operator=(const intern_pool&) = delete;
+
+		size_t size() const
+		{
+			return pool.size();
+		}
+
+		// Pooled copy of scalar x.
+		const X& intern(const X& x)
+		{
+			ensure(type(x) != xltypeMulti);
+
+			auto i = pool.find(x);
+			if (i != pool.end()) {
+				return *i;
+			}
+
+			X y = x;
+			y.xltype = type(x);
+			if (type(x) == xltypeStr) {
+				// preceded by a null owner so XOPER never frees it
+				size_t n = (str_count(x) + 1) * sizeof(xchar);
+				void* p = arena.allocate(xblock::packed(n), alignof(xblock));
+				*static_cast<std::pmr::memory_resource**>(p) = nullptr;
+				y.val.str = reinterpret_cast<xchar*>(static_cast<char*>(p) + sizeof(std::pmr::memory_resource*));
+				std::copy(x.val.str, x.val.str + str_count(x) + 1, y.val.str);
+			}
+
+			return *pool.insert(y).first;
+		}
+
+		// Copy of x in a single block with long strings shared from the pool.
+		XOPER<X> intern_multi(const X& x)
+		{
+			if (type(x) != xltypeMulti) {
+				return XOPER<X>(intern(x));
+			}
+
+			XOPER<X> o(x.val.array.rows, x.val.array.columns);
+			const X* a = (const X*)x.val.array.lparray;
+			for (size_t i = 0; i < o.size(); ++i) {
+				if (type(a[i]) == xltypeStr && str_count(a[i]) > XOPER<X>::sso_max) {
+					o[(int)i].xltype = xltypeStr;
+					o[(int)i].val.str = intern(a[i]).val.str;
+				}
+				else {
+					o.set(i, a[i]);
+				}
+			}
+
+			return o;
+		}
+	};
+
+#ifdef _DEBUG
+	inline void test_hash()
+	{
+		{
+			ensure(xxh64::hash("", 0) == 0xEF46DB3751D8E999ull);
+			ensure(xxh64::hash("a", 1) == 0xD24EC4F1A98C6E5Bull);
+			ensure(xxh64::hash("abc", 3) == 0x44BC2CF5AD770999ull);
+		}
+		{
+			ensure(hash(OPER12(0.)) == hash(OPER12(-0.)));
+			ensure(hash(OPER12(1.)) != hash(OPER12(1)));
+			ensure(hash(OPER12(L"abc")) == hash(OPER12("abc")));
+			ensure(hash(OPER12(L"abc")) != hash(OPER12(L"abd")));
+		}
+		{
+			// XLOPER counts over 127 are negative as CHAR
+			CHAR a[201], b[201];
+			a[0] = b[0] = static_cast<CHAR>(200);
+			for (int i = 1; i <= 200; ++i) {
+				a[i] = b[i] = static_cast<CHAR>('a' + i % 26);
+			}
+			b[200] = '!';
+			XLOPER x = { .val = {.str = a}, .xltype = xltypeStr };
+			XLOPER y = { .val = {.str = b}, .xltype = xltypeStr };
+			ensure(str_count(x) == 200);
+			ensure(hash(x) == hash(OPER4(x)));
+			ensure(hash(x) != hash(y));
+			ensure(!(x == y));
+			ensure(x == OPER4(x));
+
+			intern_pool<XLOPER> pool;
+			const XLOPER& p = pool.intern(x);
+			ensure(str_count(p) == 200 && p == x);
+			ensure(&p == &pool.intern(OPER4(x)));
+		}
+		{
+			OPER12 m(2, 3), m2(3, 2);
+			m[0] = OPER12(L"a string longer than inline");
+			m[4] = OPER12(1.5);
+			m2[0] = m[0];
+			m2[4] = m[4];
+			OPER12 m3(m);
+			ensure(hash(m) == hash(m3));
+			ensure(hash(m) != hash(m2));
+
+			std::unordered_set<OPER12, xloper_hash<OPER12>, xloper_equal<OPER12>> s;
+			s.insert(m);
+			ensure(s.contains(m3));
+		}
+		{
+			intern_pool<XLOPER12> pool;
+			OPER12 s(L"a string longer than inline");
+			OPER12 m(1, 3);
+			m[0] = s;
+			m[1] = s;
+			m[2] = OPER12(2.);
+
+			const XLOPER12& p = pool.intern(s);
+			ensure(&p == &pool.intern(OPER12(s)));
+			ensure(pool.size() == 1);
+
+			OPER12 o = pool.intern_multi(m);
+			ensure(o == m);
+			ensure(o[0].val.str == p.val.str);
+			ensure(o[1].val.str == p.val.str);
+			ensure(pool.size() == 1);
+		}
+	}
+#endif // _DEBUG
+
+} // namespace xll
@@ -0,0 +1,461 @@
+// host.h - stand-in for Excel using SetExcel12EntryPt
+// Implements the callbacks add-ins use most against an in-memory sheet so
+// add-ins can be driven without Excel. Traffic can be recorded to a file and
+// replayed at full speed for reproducible benchmarks and regression tests.
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cwchar>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "oper.h"
+#include "serial.h"
+
+#ifdef __cplusplus
+extern "C"
+#endif
+void pascal SetExcel12EntryPt(int (pascal* pexcel12New)(int xlfn, int coper, LPXLOPER12* rgpxloper12, LPXLOPER12 xloper12Res));
+
+namespace xll {
+
+	// In-process MdCallBack12 for xlFree, xlCoerce, xlSet, xlGetName, xlfRegister,
+	// xlfCaller, xlAbort, xlEventRegister, and xlAsyncReturn. Other functions return xlretInvXlfn.
+	// xlFree and xlAsyncReturn are always handled live and are never recorded.
+	// Only xlAbort and xlAsyncReturn may be called from other threads.
+	class host {
+	public:
+		enum class mode { live, record, replay };
+
+		// One callback and what Excel returned.
+		struct call {
+			int xlfn;
+			std::vector<OPER12> args;
+			int ret;
+			OPER12 res;
+		};
+	private:
+		static inline host* current = nullptr;
+
+		mode mode_ = mode::live;
+		std::FILE* fp = nullptr;
+		std::vector<call> calls; // replay
+		size_t next = 0;
+		size_t mismatch = 0;
+		std::map<const void*, std::unique_ptr<OPER12>> owned; // results not yet freed with xlFree
+		double id = 0;
+
+		// Memory xlFree releases for x, or nullptr if x has none.
+		static const void* allocation(const XLOPER12& x)
+		{
+			switch (type(x)) {
+			case xltypeStr:
+				return x.val.str;
+			case xltypeMulti:
+				return x.val.array.lparray;
+			case xltypeRef:
+				return x.val.mref.lpmref;
+			case xltypeBigData:
+				return x.val.bigdata.h.lpbData;
+			}
+
+			return nullptr;
+		}
+
+		// Hand out a copy of o until xlFree.
+		void result(LPXLOPER12 res, const OPER12& o)
+		{
+			auto copy = std::make_unique<OPER12>(o); // short strings point into the OPER
+			*res = *copy;
+			if (const void* p = allocation(*res)) {
+				owned[p] = std::move(copy);
+			}
+		}
+
+		static const XLREF12* first_area(const XLOPER12& x)
+		{
+			if (type(x) == xltypeSRef) {
+				return &x.val.sref.ref;
+			}
+			if (type(x) == xltypeRef && x.val.mref.lpmref && x.val.mref.lpmref->count > 0) {
+				return &x.val.mref.lpmref->reftbl[0];
+			}
+
+			return nullptr;
+		}
+
+		OPER12 value(const XLREF12& r) const
+		{
+			auto cell = [this](RW i, COL j) {
+				auto c = sheet.find({ i, j });
+				return c == sheet.end() ? OPER12() : c->second;
+			};
+			if (area(r) == 1) {
+				return cell(r.rwFirst, r.colFirst);
+			}
+
+			OPER12 o(height(r), width(r));
+			for (RW i = 0; i < height(r); ++i) {
+				for (COL j = 0; j < width(r); ++j) {
+					o(i, j) = cell(r.rwFirst + i, r.colFirst + j);
+				}
+			}
+
+			return o;
+		}
+
+		static OPER12 coerce(const OPER12& o, int types)
+		{
+			if (type(o) & types) {
+				return o;
+			}
+			if ((types & xltypeNum) && type(o) == xltypeStr) {
+				std::wstring s(o.val.str + 1, o.val.str + 1 + o.val.str[0]);
+				wchar_t* e;
+				double num = std::wcstod(s.c_str(), &e);
+				if (!s.empty() && *e == 0) {
+					return OPER12(num);
+				}
+			}
+			if ((types & xltypeNum) && (type(o) == xltypeBool || type(o) == xltypeInt || type(o) == xltypeNil)) {
+				return OPER12(type(o) == xltypeBool ? double(o.val.xbool != 0) : type(o) == xltypeInt ? double(o.val.w) : 0.);
+			}
+			if ((types & xltypeStr) && type(o) == xltypeNum) {
+				wchar_t buf[32];
+				std::swprintf(buf, 32, L"%.15g", o.val.num);
+				return OPER12(buf);
+			}
+
+			return OPER12(XlErr::Value);
+		}
+
+		int live(int xlfn, int n, LPXLOPER12 opers[], LPXLOPER12 res)
+		{
+			switch (xlfn) {
+			case xlCoerce: {
+				ensure(n >= 1);
+				const XLREF12* r = first_area(*opers[0]);
+				OPER12 o = r ? value(*r) : OPER12(*opers[0]);
+				if (n > 1 && type(*opers[1]) == xltypeInt) {
+					o = coerce(o, opers[1]->val.w);
+				}
+				else if (n > 1 && type(*opers[1]) == xltypeNum) {
+					o = coerce(o, static_cast<int>(opers[1]->val.num));
+				}
+				result(res, o);
+
+				return xlretSuccess;
+			}
+			case xlSet: {
+				ensure(n >= 1);
+				const XLREF12* r = first_area(*opers[0]);
+				if (!r) {
+					return xlretInvXloper;
+				}
+				const XLOPER12* v = n > 1 ? opers[1] : nullptr;
+				bool multi = v && type(*v) == xltypeMulti;
+				if (multi && (v->val.array.rows != height(*r) || v->val.array.columns != width(*r))) {
+					return xlretInvXloper;
+				}
+				for (RW i = 0; i < height(*r); ++i) {
+					for (COL j = 0; j < width(*r); ++j) {
+						auto key = std::make_pair(r->rwFirst + i, r->colFirst + j);
+						if (!v || type(*v) == xltypeMissing) {
+							sheet.erase(key);
+						}
+						else {
+							sheet[key] = OPER12(multi ? v->val.array.lparray[i * width(*r) + j] : *v);
+						}
+					}
+				}
+				*res = XLOPER12{ .val = {.xbool = TRUE}, .xltype = xltypeBool };
+
+				return xlretSuccess;
+			}
+			case xlGetName:
+				result(res, OPER12(name.c_str()));
+
+				return xlretSuccess;
+			case xlfRegister:
+				ensure(n >= 2);
+				registered.emplace_back(*opers[1]);
+				*res = XLOPER12{ .val = {.num = ++id}, .xltype = xltypeNum };
+
+				return xlretSuccess;
+			case xlfCaller:
+				*res = XLOPER12{ .val = {.sref = {.count = 1, .ref = caller}}, .xltype = xltypeSRef };
+
+				return xlretSuccess;
+			case xlAbort:
+				*res = XLOPER12{ .val = {.xbool = abort}, .xltype = xltypeBool };
+
+				return xlretSuccess;
+			case xlEventRegister:
+				*res = XLOPER12{ .val = {.xbool = TRUE}, .xltype = xltypeBool };
+
+				return xlretSuccess;
+			}
+
+			return xlretInvXlfn;
+		}
+
+		int replay(int xlfn, int n, LPXLOPER12 opers[], LPXLOPER12 res)
+		{
+			if (next == calls.size()) {
+				++mismatch;
+
+				return xlretFailed;
+			}
+			const call& c = calls[next++];
+			bool same = c.xlfn == xlfn && static_cast<int>(c.args.size()) == n;
+			for (int i = 0; same && i < n; ++i) {
+				OPER12 a(*opers[i]);
+				if (type(a) == xltypeRef) {
+					a = OPER12(XLOPER12{ .val = {.sref = {.count = 1, .ref = *first_area(*opers[i])}}, .xltype = xltypeSRef });
+				}
+				same = c.args[i] == a;
+			}
+			if (!same) {
+				++mismatch;
+			}
+			result(res, c.res);
+
+			return c.ret;
+		}
+	public:
+		// In-memory sheet used in live and record mode.
+		std::map<std::pair<RW, COL>, OPER12> sheet;
+		// Cell returned by xlfCaller.
+		REF caller;
+		// Returned by xlGetName.
+		std::wstring name = L"stand_in.xll";
+		// Returned by xlAbort.
+		BOOL abort = FALSE;
+		// Procedure names passed to xlfRegister.
+		std::vector<OPER12> registered;
+		// Return codes to give for xlfn instead of handling it, e.g. to test failures.
+		std::map<int, int> fail;
+		// Callbacks made to this host.
+		std::atomic<size_t> callbacks = 0;
+		// Handle and value passed to xlAsyncReturn.
+		std::vector<std::pair<HANDLE, OPER12>> async_returns;
+		std::mutex async_mutex;
+
+		host() = default;
+		host(const host&) = delete;
+		host& operator=(const host&) = delete;
+		~host()
+		{
+			if (fp) {
+				std::fclose(fp);
+			}
+			if (current == this) {
+				current = nullptr;
+			}
+		}
+
+		// Route Excel12v to this host.
+		host& install()
+		{
+			if (!current) {
+				SetExcel12EntryPt(callback);
+			}
+			current = this;
+
+			return *this;
+		}
+		static int pascal callback(int xlfn, int n, LPXLOPER12 opers[], LPXLOPER12 res)
+		{
+			return current ? (*current)(xlfn, n, opers, res) : xlretFailed;
+		}
+
+		// Append callbacks to fp. The host takes ownership of fp.
+		host& record(std::FILE* fp_)
+		{
+			ensure(fp_);
+			fp = fp_;
+			mode_ = mode::record;
+
+			return *this;
+		}
+		host& record(const char* path)
+		{
+			return record(std::fopen(path, "wb"));
+		}
+
+		// Return recorded results in order.
+		host& replay(std::FILE* fp_)
+		{
+			ensure(fp_);
+			calls.clear();
+			int xlfn;
+			while (1 == std::fread(&xlfn, sizeof(xlfn), 1, fp_)) {
+				call c{ .xlfn = xlfn };
+				int n = serial::read<int32_t>(fp_);
+				for (int i = 0; i < n; ++i) {
+					c.args.push_back(serial::read_oper(fp_));
+				}
+				c.ret = serial::read<int32_t>(fp_);
+				c.res = serial::read_oper(fp_);
+				calls.push_back(std::move(c));
+			}
+			next = 0;
+			mismatch = 0;
+			mode_ = mode::replay;
+
+			return *this;
+		}
+		host& replay(const char* path)
+		{
+			std::FILE* fp_ = std::fopen(path, "rb");
+			replay(fp_);
+			std::fclose(fp_);
+
+			return *this;
+		}
+
+		// Stop recording and return the file without closing it.
+		std::FILE* release()
+		{
+			std::FILE* fp_ = fp;
+			fp = nullptr;
+			mode_ = mode::live;
+
+			return fp_;
+		}
+
+		// Calls left to replay.
+		size_t remaining() const
+		{
+			return calls.size() - next;
+		}
+		// Replayed calls that did not match the recording.
+		size_t mismatches() const
+		{
+			return mismatch;
+		}
+		// Results not released with xlFree.
+		size_t outstanding() const
+		{
+			return owned.size();
+		}
+
+		int operator()(int xlfn, int n, LPXLOPER12 opers[], LPXLOPER12 res)
+		{
+			++callbacks;
+			if (auto f = fail.find(xlfn); f != fail.end()) {
+				return f->second;
+			}
+
+			if (xlfn == xlFree) {
+				for (int i = 0; i < n; ++i) {
+					if (const void* p = allocation(*opers[i])) {
+						owned.erase(p);
+					}
+				}
+
+				return xlretSuccess;
+			}
+
+			if (xlfn == xlAsyncReturn) {
+				if (n != 2 || type(*opers[0]) != xltypeBigData) {
+					return xlretInvAsynchronousContext;
+				}
+				std::lock_guard lock(async_mutex);
+				async_returns.emplace_back(opers[0]->val.bigdata.h.hdata, OPER12(*opers[1]));
+				*res = XLOPER12{ .val = {.xbool = TRUE}, .xltype = xltypeBool };
+
+				return xlretSuccess;
+			}
+
+			if (mode_ == mode::replay) {
+				return replay(xlfn, n, opers, res);
+			}
+
+			int ret = live(xlfn, n, opers, res);
+			if (mode_ == mode::record) {
+				serial::write(fp, static_cast<int32_t>(xlfn));
+				serial::write(fp, static_cast<int32_t>(n));
+				for (int i = 0; i < n; ++i) {
+					serial::write(fp, *opers[i]);
+				}
+				serial::write(fp, static_cast<int32_t>(ret));
+				serial::write(fp, ret == xlretSuccess ? *res : XLOPER12{ .xltype = xltypeNil });
+			}
+
+			return ret;
+		}
+	};
+
+#ifdef _DEBUG
+	inline void test_host()
+	{
+		std::FILE* fp = std::tmpfile();
+		{
+			host h;
+			h.record(fp);
+			XLOPER12 res;
+			OPER12 ref(XLOPER12{ .val = {.sref = {.count = 1, .ref = REF(1, 2, 1, 2)}}, .xltype = xltypeSRef });
+			OPER12 m(1, 2);
+			m[0] = OPER12(1.5);
+			m[1] = OPER12(L"abc");
+			LPXLOPER12 args[2] = { &ref, &m };
+			ensure(xlretSuccess == h(xlSet, 2, args, &res));
+			ensure(h.sheet.size() == 2);
+
+			ensure(xlretSuccess == h(xlCoerce, 1, args, &res));
+			ensure(res == m);
+			ensure(h.outstanding() == 1);
+			LPXLOPER12 pres[1] = { &res };
+			ensure(xlretSuccess == h(xlFree, 1, pres, nullptr));
+			ensure(h.outstanding() == 0);
+
+			// scalars own nothing, even if their bits look like a tracked pointer
+			ensure(xlretSuccess == h(xlCoerce, 1, args, &res));
+			ensure(h.outstanding() == 1);
+			XLOPER12 x = { .xltype = xltypeNum };
+			std::memcpy(&x.val.num, &res.val.array.lparray, sizeof(res.val.array.lparray));
+			LPXLOPER12 pnum[1] = { &x };
+			ensure(xlretSuccess == h(xlFree, 1, pnum, nullptr));
+			ensure(h.outstanding() == 1);
+			ensure(xlretSuccess == h(xlFree, 1, pres, nullptr));
+			ensure(h.outstanding() == 0);
+
+			OPER12 types(xltypeNum);
+			OPER12 one(XLOPER12{ .val = {.sref = {.count = 1, .ref = REF(1, 3)}}, .xltype = xltypeSRef });
+			OPER12 num(L"2.5");
+			h.sheet[{1, 3}] = num;
+			LPXLOPER12 cargs[2] = { &one, &types };
+			ensure(xlretSuccess == h(xlCoerce, 2, cargs, &res));
+			ensure(res.val.num == 2.5);
+
+			ensure(xlretInvXlfn == h(xlfEvaluate, 0, nullptr, &res));
+			h.release(); // leave fp open for replay
+		}
+		std::rewind(fp);
+		{
+			host h;
+			h.replay(fp);
+			ensure(h.remaining() == 5);
+			XLOPER12 res;
+			OPER12 ref(XLOPER12{ .val = {.sref = {.count = 1, .ref = REF(1, 2, 1, 2)}}, .xltype = xltypeSRef });
+			LPXLOPER12 args[1] = { &ref };
+			OPER12 m(1, 2);
+			LPXLOPER12 sargs[2] = { &ref, &m };
+			h(xlSet, 2, sargs, &res); // different value
+			ensure(h.mismatches() == 1);
+			ensure(xlretSuccess == h(xlCoerce, 1, args, &res));
+			ensure(h.mismatches() == 1);
+			ensure(type(res) == xltypeMulti);
+			ensure(res.val.array.lparray[1] == OPER12(L"abc"));
+		}
+		std::fclose(fp);
+	}
+#endif // _DEBUG
+
+} // namespace xll
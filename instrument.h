@@ -0,0 +1,201 @@
+// instrument.h - per-function counts and latency of Excel callbacks
+// Define XLL_INSTRUMENT to record every call made through traits<X>::Excelv.
+// Each thread writes its own counters so recording takes no locks and
+// readers may take a snapshot at any time.
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <vector>
+#include <Windows.h>
+#include "XLCALL.H"
+#include "ensure.h"
+
+namespace xll::instrument {
+
+	inline constexpr int buckets = 32; // latency histogram by bit width of nanoseconds
+	inline constexpr int rets = 11;    // xlretSuccess then one per xlret bit
+	inline constexpr int slots = 128;  // distinct xlfn per thread
+
+	struct counter {
+		std::atomic<int> xlfn{ -1 };
+		std::atomic<uint64_t> count{ 0 };
+		std::atomic<uint64_t> nanos{ 0 };
+		std::atomic<uint64_t> latency[buckets] = {};
+		std::atomic<uint64_t> ret[rets] = {};
+	};
+
+	struct thread_counters {
+		counter slot[slots];
+		std::atomic<uint64_t> dropped{ 0 }; // calls with no free slot
+		thread_counters* next = nullptr;
+	};
+
+	// Counters of every thread that made a callback.
+	inline std::atomic<thread_counters*> head{ nullptr };
+
+	// Only the owning thread writes so no read-modify-write is needed.
+	inline void add(std::atomic<uint64_t>& a, uint64_t n) noexcept
+	{
+		a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	inline thread_counters& local()
+	{
+		// never freed so counts outlive the thread
+		thread_local thread_counters* p = [] {
+			auto t = new thread_counters;
+			t->next = head.load(std::memory_order_relaxed);
+			while (!head.compare_exchange_weak(t->next, t, std::memory_order_release, std::memory_order_relaxed))
+				;
+			return t;
+		}();
+
+		return *p;
+	}
+
+	// Slot for xlfn using linear probing or nullptr if full.
+	inline counter* find(thread_counters& t, int xlfn) noexcept
+	{
+		unsigned h = (static_cast<unsigned>(xlfn) * 0x9E3779B9u) >> 25; // 7 bits
+		for (int i = 0; i < slots; ++i) {
+			counter& c = t.slot[(h + i) % slots];
+			int k = c.xlfn.load(std::memory_order_relaxed);
+			if (k == xlfn) {
+				return &c;
+			}
+			if (k == -1) {
+				c.xlfn.store(xlfn, std::memory_order_release);
+				return &c;
+			}
+		}
+
+		return nullptr;
+	}
+
+	inline constexpr int bucket(uint64_t ns) noexcept
+	{
+		return std::min(static_cast<int>(std::bit_width(ns)), buckets - 1);
+	}
+	inline constexpr int ret_index(int ret) noexcept
+	{
+		return std::min(static_cast<int>(std::bit_width(static_cast<unsigned>(ret))), rets - 1);
+	}
+
+	inline void record(int xlfn, uint64_t ns, int ret) noexcept
+	{
+		thread_counters& t = local();
+		counter* c = find(t, xlfn);
+		if (!c) {
+			add(t.dropped, 1);
+
+			return;
+		}
+		add(c->count, 1);
+		add(c->nanos, ns);
+		add(c->latency[bucket(ns)], 1);
+		add(c->ret[ret_index(ret)], 1);
+	}
+
+	// Time f() and record it under xlfn.
+	template<class F>
+	inline int call(int xlfn, F&& f)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		int ret = f();
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+		record(xlfn, static_cast<uint64_t>(ns), ret);
+
+		return ret;
+	}
+
+	// Totals over all threads.
+	struct stats {
+		int xlfn = 0;
+		uint64_t count = 0;
+		uint64_t nanos = 0;
+		uint64_t latency[buckets] = {};
+		uint64_t ret[rets] = {};
+
+		double mean() const
+		{
+			return count ? 1e-9 * static_cast<double>(nanos) / static_cast<double>(count) : 0;
+		}
+		// Upper bound in seconds of the latency at quantile q.
+		double quantile(double q) const
+		{
+			uint64_t n = 0;
+			for (int b = 0; b < buckets; ++b) {
+				n += latency[b];
+				if (n && static_cast<double>(n) >= q * static_cast<double>(count)) {
+					return 1e-9 * static_cast<double>(uint64_t(1) << b);
+				}
+			}
+
+			return 0;
+		}
+		uint64_t failed() const
+		{
+			return count - ret[0];
+		}
+	};
+
+	// Stats by xlfn in increasing order.
+	inline std::vector<stats> snapshot()
+	{
+		std::map<int, stats> m;
+
+		for (auto t = head.load(std::memory_order_acquire); t; t = t->next) {
+			for (const counter& c : t->slot) {
+				int xlfn = c.xlfn.load(std::memory_order_acquire);
+				if (xlfn == -1) {
+					continue;
+				}
+				stats& s = m[xlfn];
+				s.xlfn = xlfn;
+				s.count += c.count.load(std::memory_order_relaxed);
+				s.nanos += c.nanos.load(std::memory_order_relaxed);
+				for (int b = 0; b < buckets; ++b) {
+					s.latency[b] += c.latency[b].load(std::memory_order_relaxed);
+				}
+				for (int r = 0; r < rets; ++r) {
+					s.ret[r] += c.ret[r].load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		std::vector<stats> v;
+		v.reserve(m.size());
+		for (const auto& [xlfn, s] : m) {
+			v.push_back(s);
+		}
+
+		return v;
+	}
+
+#ifdef _DEBUG
+	inline void test_instrument()
+	{
+		static_assert(0 == bucket(0));
+		static_assert(1 == ret_index(xlretAbort));
+		static_assert(10 == ret_index(xlretNotClusterSafe));
+		{
+			const int xlfn = 0x7FFF0001; // not a real function
+			record(xlfn, 100, xlretSuccess);
+			record(xlfn, 1000, xlretFailed);
+			call(xlfn, [] { return xlretSuccess; });
+			auto v = snapshot();
+			auto s = std::find_if(v.begin(), v.end(), [](const stats& s) { return s.xlfn == xlfn; });
+			ensure(s != v.end());
+			ensure(s->count == 3);
+			ensure(s->failed() == 1);
+			ensure(s->ret[ret_index(xlretFailed)] == 1);
+			ensure(s->quantile(1) >= 1e-6);
+		}
+	}
+#endif // _DEBUG
+
+} // namespace xll::instrument
@@ -0,0 +1,284 @@
+// multi.h - operations on every cell of a range in one pass
+/*
+	classify and to_num are conveniences for whole-range type checks and numeric
+	copies. A pass over a large range is bound by reading the cells, so they are
+	no faster than a loop calling type() or as_num() on each cell.
+*/
+#pragma once
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "oper.h"
+
+namespace xll {
+
+	// Pointer to first cell and number of cells. Scalars are a 1 x 1 range.
+	template<XlOper X>
+	inline std::pair<const X*, std::size_t> cells(const X& x)
+	{
+		if (type(x) == xltypeMulti) {
+			return { (const X*)x.val.array.lparray, (std::size_t)x.val.array.rows * x.val.array.columns };
+		}
+
+		return { &x, 1 };
+	}
+
+	// Number of cells of each xltype.
+	struct xltype_count {
+		// BigData is Str | Int so it is counted in the slot of xlbitXLFree,
+		// a bit type() never returns.
+		static constexpr unsigned bigdata = std::countr_zero(unsigned(xlbitXLFree));
+
+		// count[k] is the number of cells having type 1 << k
+		std::array<std::size_t, 16> count = {};
+
+		static constexpr unsigned slot(unsigned t) noexcept
+		{
+			return t == xltypeBigData ? bigdata : std::countr_zero(t | 0x8000u);
+		}
+		// Count of cells with the single type bit t or xltypeBigData.
+		std::size_t operator[](unsigned t) const noexcept
+		{
+			return count[slot(t)];
+		}
+		std::size_t total() const noexcept
+		{
+			std::size_t n = 0;
+			for (auto c : count) {
+				n += c;
+			}
+
+			return n;
+		}
+	};
+
+	// Count types of n cells and set bit i of mask[i/64] if type(x[i]) & types.
+	// BigData cells only match if types has both of its bits.
+	// Mask must have room for (n + 63)/64 words if not null.
+	template<XlOper X>
+	inline xltype_count classify(const X* x, std::size_t n, unsigned types = 0, std::uint64_t* mask = nullptr)
+	{
+		xltype_count c;
+
+		for (std::size_t w = 0; w * 64 < n; ++w) {
+			std::size_t e = std::min(n, w * 64 + 64);
+			std::uint64_t m = 0;
+			for (std::size_t i = w * 64; i < e; ++i) {
+				unsigned t = type(x[i]);
+				++c.count[xltype_count::slot(t)];
+				bool hit = t == xltypeBigData ? (types & xltypeBigData) == xltypeBigData : (t & types) != 0;
+				m |= std::uint64_t(hit) << (i - w * 64);
+			}
+			if (mask) {
+				mask[w] = m;
+			}
+		}
+
+		return c;
+	}
+	template<XlOper X>
+	inline xltype_count classify(const X& x, unsigned types = 0, std::uint64_t* mask = nullptr)
+	{
+		auto [p, n] = cells(x);
+
+		return classify(p, n, types, mask);
+	}
+
+	// Dense copy of numeric cells using as_num rules. Other cells are set to fill.
+	// Return the number of cells that were Num, Bool, or Int.
+	template<XlOper X>
+	inline std::size_t to_num(const X* x, std::size_t n, double* out,
+		double fill = std::numeric_limits<double>::quiet_NaN())
+	{
+		std::size_t k = 0;
+
+		for (std::size_t i = 0; i < n; ++i) {
+			unsigned t = type(x[i]);
+			double num = t == xltypeNum ? x[i].val.num : fill;
+			num = t == xltypeBool ? static_cast<double>(x[i].val.xbool) : num;
+			num = t == xltypeInt ? static_cast<double>(x[i].val.w) : num;
+			out[i] = num;
+			k += (t == xltypeNum) + (t == xltypeBool) + (t == xltypeInt); // exact so BigData is not counted
+		}
+
+		return k;
+	}
+	template<XlOper X>
+	inline std::size_t to_num(const X& x, double* out,
+		double fill = std::numeric_limits<double>::quiet_NaN())
+	{
+		auto [p, n] = cells(x);
+
+		return to_num(p, n, out, fill);
+	}
+
+	// UTF-8 strings of a range packed into one buffer.
+	struct utf8_table {
+		static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+		struct entry {
+			std::size_t offset; // npos if cell is not a string
+			std::size_t length;
+		};
+		std::string arena;
+		std::vector<entry> index; // one entry per cell in row-major order
+
+		bool is_str(std::size_t i) const noexcept
+		{
+			return index[i].offset != npos;
+		}
+		std::string_view operator[](std::size_t i) const noexcept
+		{
+			return is_str(i) ? std::string_view(arena.data() + index[i].offset, index[i].length) : std::string_view{};
+		}
+	};
+
+	// Convert every string in x to UTF-8 in a single arena.
+	inline utf8_table to_utf8(const XLOPER12& x)
+	{
+		utf8_table t;
+		auto [p, n] = cells(x);
+
+		// size from the counts only, then one pass over the characters
+		std::size_t bytes = 0;
+		for (std::size_t i = 0; i < n; ++i) {
+			if (type(p[i]) == xltypeStr) {
+				bytes += utf8::encode_max(p[i].val.str[0]);
+			}
+		}
+		t.arena.resize(bytes);
+		t.index.resize(n);
+
+		std::size_t off = 0;
+		for (std::size_t i = 0; i < n; ++i) {
+			if (type(p[i]) == xltypeStr) {
+				std::ptrdiff_t len = utf8::encode(p[i].val.str + 1, p[i].val.str[0], t.arena.data() + off, bytes - off);
+				ensure(len >= 0);
+				t.index[i] = { off, static_cast<std::size_t>(len) };
+				off += len;
+			}
+			else {
+				t.index[i] = { utf8_table::npos, 0 };
+			}
+		}
+		t.arena.resize(off);
+
+		return t;
+	}
+
+	// r x c Multi of counted strings from n entries into arena using a single allocation.
+	// Entries with offset npos become Nil.
+	inline OPER12 from_utf8(const char* arena, const utf8_table::entry* index, std::size_t n,
+		OPER12::xrw r, OPER12::xcol c, std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+	{
+		ensure(n <= static_cast<std::size_t>(r) * c);
+
+		std::size_t extra = 0;
+		for (std::size_t i = 0; i < n; ++i) {
+			if (index[i].offset != utf8_table::npos) {
+				extra += OPER12::str_bytes(std::min(utf8::decode_max(index[i].length), traits<XLOPER12>::str_max - 1));
+			}
+		}
+
+		OPER12 o(r, c, extra, mr);
+		for (std::size_t i = 0; i < n; ++i) {
+			if (index[i].offset != utf8_table::npos) {
+				std::size_t wn = std::min(utf8::decode_max(index[i].length), traits<XLOPER12>::str_max - 1);
+				ensure(utf8::decode_counted(arena + index[i].offset, index[i].length, o.set_str(i, wn), wn));
+			}
+		}
+
+		return o;
+	}
+	inline OPER12 from_utf8(const utf8_table& t, OPER12::xrw r, OPER12::xcol c,
+		std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+	{
+		return from_utf8(t.arena.data(), t.index.data(), t.index.size(), r, c, mr);
+	}
+
+#ifdef _DEBUG
+	inline void test_multi_utf8()
+	{
+		OPER12 m(2, 2);
+		m[0] = OPER12("a string longer than inline");
+		m[1] = OPER12(1.5);
+		m[2] = OPER12("\xE2\x82\xAC");
+		{
+			utf8_table t = to_utf8(m);
+			ensure(t.index.size() == 4);
+			ensure(t[0] == "a string longer than inline");
+			ensure(!t.is_str(1));
+			ensure(t[2] == "\xE2\x82\xAC");
+			ensure(!t.is_str(3));
+			ensure(t.arena.size() == 27 + 3);
+
+			OPER12 o = from_utf8(t, 2, 2);
+			ensure(o[0] == m[0]);
+			ensure(o[1].xltype == xltypeNil);
+			ensure(o[2] == m[2]);
+			ensure(xblock::owner(o[0].val.str) == nullptr);
+		}
+	}
+	inline void test_multi_classify()
+	{
+		OPER12 m(2, 3);
+		m[0] = OPER12(1.5);
+		m[1] = OPER12(L"str");
+		m[2] = OPER12(true);
+		m[3] = OPER12(XlErr::NA);
+		m[4] = OPER12(7);
+		BYTE data[] = { 1, 2 };
+		XLOPER12 big = { .xltype = xltypeBigData };
+		big.val.bigdata.h.lpbData = data;
+		big.val.bigdata.cbData = 2;
+		{
+			std::uint64_t mask[1];
+			auto c = classify(m, xltypeNum | xltypeBool | xltypeInt, mask);
+			ensure(c.total() == 6);
+			ensure(c[xltypeNum] == 1);
+			ensure(c[xltypeStr] == 1);
+			ensure(c[xltypeBool] == 1);
+			ensure(c[xltypeErr] == 1);
+			ensure(c[xltypeInt] == 1);
+			ensure(c[xltypeNil] == 1);
+			ensure(mask[0] == 0b010101);
+		}
+		{
+			double a[6];
+			ensure(3 == to_num(m, a, -1.));
+			ensure(a[0] == 1.5);
+			ensure(a[1] == -1);
+			ensure(a[2] == 1);
+			ensure(a[3] == -1);
+			ensure(a[4] == 7);
+			ensure(a[5] == -1);
+		}
+		{
+			OPER12 x(2.5);
+			double a;
+			ensure(1 == to_num(x, &a));
+			ensure(a == 2.5);
+		}
+		{
+			// BigData is neither Str nor Int
+			XLOPER12 x[2] = { big, m[4] };
+			std::uint64_t mask[1];
+			auto c = classify(x, 2, xltypeStr | xltypeInt, mask);
+			ensure(c[xltypeBigData] == 1);
+			ensure(c[xltypeStr] == 0);
+			ensure(c[xltypeInt] == 1);
+			ensure(mask[0] == 0b11);
+			classify(x, 2, xltypeInt, mask);
+			ensure(mask[0] == 0b10);
+			double a[2];
+			ensure(1 == to_num(x, 2, a, -1.));
+			ensure(a[0] == -1 && a[1] == 7);
+		}
+	}
+#endif // _DEBUG
+
+} // namespace xll
@@ -1,9 +1,11 @@
 // oper.h - Excel cell or 2-d range of cells
 #pragma once
 #include <concepts>
-#include <scoped_allocator>
+#include <cstring>
+#include <memory_resource>
 #include <type_traits>
 #include "utf8.h"
+#include "xlfree.h"
 #include "xloper.h"
 
 namespace xll {
@@ -25,39 +27,211 @@ namespace xll {
 		return n;
 	}
 	*/
+	// Header preceding every allocation made by XOPER.
+	// Strings packed into a Multi block are preceded only by a null resource.
+	struct xblock {
+		size_t bytes; // allocated size including header
+		size_t used;  // bytes in use including header
+		std::pmr::memory_resource* mr; // must be last
+
+		static constexpr size_t round(size_t n)
+		{
+			return (n + alignof(xblock) - 1) & ~(alignof(xblock) - 1);
+		}
+		// Bytes needed to pack n bytes into the tail of a block.
+		static constexpr size_t packed(size_t n)
+		{
+			return sizeof(std::pmr::memory_resource*) + round(n);
+		}
+		static void* alloc(size_t n, std::pmr::memory_resource* mr)
+		{
+			size_t bytes = sizeof(xblock) + round(n);
+			xblock* b = static_cast<xblock*>(mr->allocate(bytes, alignof(xblock)));
+			b->bytes = bytes;
+			b->used = bytes;
+			b->mr = mr;
+
+			return b + 1;
+		}
+		// Allocate n bytes and leave room for extra packed bytes.
+		static void* alloc(size_t n, size_t extra, std::pmr::memory_resource* mr)
+		{
+			void* p = alloc(round(n) + extra, mr);
+			header(p)->used = sizeof(xblock) + round(n);
+
+			return p;
+		}
+		static xblock* header(const void* p)
+		{
+			return static_cast<xblock*>(const_cast<void*>(p)) - 1;
+		}
+		// Resource that owns p or nullptr if p lives in an enclosing block.
+		static std::pmr::memory_resource* owner(const void* p)
+		{
+			return static_cast<std::pmr::memory_resource* const*>(p)[-1];
+		}
+		static void free(const void* p)
+		{
+			if (std::pmr::memory_resource* mr = owner(p)) {
+				xblock* b = header(p);
+				mr->deallocate(b, b->bytes, alignof(xblock));
+			}
+		}
+		// Pack n bytes into the unused tail of block p. Return nullptr if full.
+		static void* pack(const void* p, size_t n)
+		{
+			xblock* b = header(p);
+			if (b->used + packed(n) > b->bytes) {
+				return nullptr;
+			}
+
+			char* q = reinterpret_cast<char*>(b) + b->used;
+			*reinterpret_cast<std::pmr::memory_resource**>(q) = nullptr;
+			b->used += packed(n);
+
+			return q + sizeof(std::pmr::memory_resource*);
+		}
+	};
+
 	template<is_xloper X>
 	struct XOPER : X {
+		using type = X;
 		using xchar = traits<X>::xchar;
 		using charx = traits<X>::charx;
+		using xrw = traits<X>::xrw;
+		using xcol = traits<X>::xcol;
 		using X::xltype;
 		using X::val;
+		// Short strings are stored in the unused tail of val after the str pointer.
+		static constexpr size_t sso_max = (sizeof(X::val) - sizeof(xchar*)) / sizeof(xchar) - 1;
+		static_assert(sizeof(X::val) >= sizeof(xchar*) + 2 * sizeof(xchar));
+		static_assert(sizeof(X) % alignof(xblock) == 0);
 	private:
+		xchar* sso_buf() noexcept
+		{
+			return reinterpret_cast<xchar*>(reinterpret_cast<char*>(&val) + sizeof(xchar*));
+		}
+		const xchar* sso_buf() const noexcept
+		{
+			return reinterpret_cast<const xchar*>(reinterpret_cast<const char*>(&val) + sizeof(xchar*));
+		}
 		void swap(XOPER& x)
 		{
+			bool sso = is_sso();
+			bool x_sso = x.is_sso();
+
 			std::swap(xltype, x.xltype);
 			std::swap(val, x.val);
+
+			// inline buffers moved with val so point at the new owner
+			if (x_sso) {
+				val.str = sso_buf();
+			}
+			if (sso) {
+				x.val.str = x.sso_buf();
+			}
 		}
-		void alloc_str(size_t len, const xchar* str)
+		// Long string packed in the tail of a Multi block. It has no owner.
+		bool is_packed() const noexcept
 		{
-			ensure(len <= traits<X>::str_max);
-
-			xltype = xltypeStr;
-			val.str = new xchar[len + 1];
-			//new xchar[len + 1];
-			val.str[0] = static_cast<xchar>(len);
+			return X::xltype == xltypeStr && !is_sso() && xblock::owner(val.str) == nullptr;
+		}
+		void alloc_str(size_t len, const xchar* str, std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+		{
+			str_alloc(len, mr);
 			// stop if str is null terminated
 			for (size_t i = 0; i < len && str[i]; ++i) {
 				val.str[i + 1] = str[i];
 			}
 		}
+		// Block bytes needed for the string payload of x.
+		static size_t str_bytes(const X& x)
+		{
+			return xll::type(x) == xltypeStr && str_count(x) > sso_max
+				? xblock::packed((str_count(x) + 1) * sizeof(xchar)) : 0;
+		}
+		// Copy a non-Multi value into this.
+		void scalar(const X& x, std::pmr::memory_resource* mr)
+		{
+			ensure(xll::type(x) != xltypeMulti);
+
+			if (xll::type(x) == xltypeStr) {
+				alloc_str(str_count(x), x.val.str + 1, mr);
+			}
+			else {
+				val = x.val;
+				xltype = xll::type(x);
+			}
+		}
+		// Copy x into cell i packing long strings into the block tail.
+		void place(size_t i, const X& x)
+		{
+			if (xll::type(x) == xltypeStr) {
+				xchar* str = set_str(i, str_count(x));
+				std::copy(x.val.str + 1, x.val.str + 1 + str_count(x), str + 1);
+			}
+			else {
+				cell(i).scalar(x, resource());
+			}
+		}
+		XOPER& cell(size_t i)
+		{
+			return static_cast<XOPER*>(val.array.lparray)[i];
+		}
+		size_t cells() const
+		{
+			return X::xltype == xltypeMulti ? (size_t)val.array.rows * val.array.columns : 0;
+		}
+		// Uninitialized Multi block with extra bytes for strings.
+		void multi_alloc(xrw r, xcol c, size_t extra, std::pmr::memory_resource* mr)
+		{
+			ensure(r >= 0 && (size_t)r <= traits<X>::rw_max);
+			ensure(c >= 0 && (size_t)c <= traits<X>::col_max);
+
+			size_t n = (size_t)r * c;
+			val.array.lparray = static_cast<X*>(xblock::alloc(n * sizeof(X), extra, mr));
+			val.array.rows = r;
+			val.array.columns = c;
+			xltype = xltypeMulti;
+			for (size_t i = 0; i < n; ++i) {
+				val.array.lparray[i].xltype = xltypeNil;
+			}
+		}
+		// Copy n cells of x into a single block for r x c Multi.
+		void multi_copy(xrw r, xcol c, const X* x, size_t n, std::pmr::memory_resource* mr)
+		{
+			size_t extra = 0;
+			for (size_t i = 0; i < n; ++i) {
+				extra += str_bytes(x[i]);
+			}
+
+			multi_alloc(r, c, extra, mr);
+			for (size_t i = 0; i < n; ++i) {
+				place(i, x[i]);
+			}
+		}
 		void _XOPER()
 		{
 			if (X::xltype == xltypeStr) {
-				delete[] val.str;
+				if (!is_sso()) {
+					xblock::free(val.str);
+				}
+			}
+			else if (X::xltype == xltypeMulti) {
+				// only cells assigned after construction own memory
+				for (size_t i = 0; i < cells(); ++i) {
+					cell(i)._XOPER();
+				}
+				xblock::free(val.array.lparray);
 			}
 			else if (X::xltype & xlbitXLFree) {
-				X* this_[1] = { this };
-				traits<X>::Excelv(xlFree, 0, 1, (X**)this_);
+				if (auto q = free_queue<X>::current()) {
+					q->push(*this);
+				}
+				else {
+					X* this_[1] = { this };
+					traits<X>::Excelv(xlFree, 0, 1, (X**)this_);
+				}
 			}
 
 			xltype = xltypeNil;
@@ -66,30 +240,15 @@ namespace xll {
 		XOPER()
 			: X{ .xltype = xltypeNil }
 		{ }
-		XOPER(const X& x)
-			: X{.xltype = xll::type(x)}
-		{
-			switch (xltype) {
-			case xltypeNum:
-				val.num = x.val.num;
-				break;
-			case xltypeStr:
-				alloc_str(x.val.str[0], x.val.str + 1);
-				break;
-			case xltypeBool:
-				val.xbool = x.val.xbool;
-				break;
-			case xltypeErr:
-				val.err = x.val.err;
-				break;
-			//case xltypeMulti:
-			case xltypeSRef:
-				val.sref.ref = x.val.sref.ref;
-				break;
-			case xltypeInt:
-				val.w = x.val.w;
-				break;
-			//case xltypeMulti:
+		XOPER(const X& x, std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+			: X{ .xltype = xltypeNil }
+		{
+			if (xll::type(x) == xltypeMulti) {
+				multi_copy(x.val.array.rows, x.val.array.columns,
+					x.val.array.lparray, (size_t)x.val.array.rows * x.val.array.columns, mr);
+			}
+			else {
+				scalar(x, mr);
 			}
 		}
 		XOPER(const XOPER& o)
@@ -105,14 +264,32 @@ namespace xll {
 
 			return *this;
 		}
+		// Packed strings are copied since the block they live in can die first.
 		XOPER(XOPER&& o)
 			: XOPER{}
 		{
-			swap(o);
+			if (o.is_packed()) {
+				XOPER o_(static_cast<const X&>(o));
+				swap(o_);
+			}
+			else {
+				swap(o);
+			}
 		}
 		XOPER& operator=(XOPER&& o)
 		{
-			swap(o);
+			if (this != &o) {
+				if (is_packed()) {
+					_XOPER(); // don't hand the block pointer to o
+				}
+				if (o.is_packed()) {
+					XOPER o_(static_cast<const X&>(o));
+					swap(o_);
+				}
+				else {
+					swap(o);
+				}
+			}
 
 			return *this;
 		}
@@ -120,15 +297,26 @@ namespace xll {
 		{
 			_XOPER();
 		}
+
+		// True if string is stored in val instead of on the heap.
+		bool is_sso() const noexcept
+		{
+			return X::xltype == xltypeStr && val.str == sso_buf();
+		}
 		constexpr bool operator==(const X& o) const
 		{
-			return operator==(*this, o);
+			return xll::operator==(static_cast<const X&>(*this), o);
 		}
 
 		size_t size() const
 		{
 			return xll::size(*this);
 		}
+		// Release memory, including Excel owned memory, and become Nil.
+		void reset()
+		{
+			_XOPER();
+		}
 
 		// Num
 		explicit XOPER(double num)
@@ -160,9 +348,22 @@ namespace xll {
 #endif // _DEBUG
 
 		// Str
+		// Replace with a counted string buffer having room for len characters.
+		xchar* str_alloc(size_t len, std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+		{
+			ensure(len < traits<X>::str_max);
+
+			_XOPER();
+			xltype = xltypeStr;
+			val.str = len <= sso_max ? sso_buf() : static_cast<xchar*>(xblock::alloc((len + 1) * sizeof(xchar), mr));
+			val.str[0] = static_cast<xchar>(len);
+
+			return val.str;
+		}
 		XOPER(size_t len, const xchar* str)
+			: X{ .xltype = xltypeNil }
 		{
-			str_alloc(len, str);
+			alloc_str(len, str);
 		}
 		explicit XOPER(const xchar* str)
 			: XOPER(len(str), str)
@@ -172,13 +373,14 @@ namespace xll {
 			: XOPER(N - 1, str)
 		{ }
 #if XLL_VERSION == 12
-		XOPER(const char* str, int len = -1)
+		// UTF-8 to counted UTF-16 in one pass. Null terminated if len = -1.
+		XOPER(const char* str, int len = -1) requires std::same_as<X, XLOPER12>
+			: X{ .xltype = xltypeNil }
 		{
-			xltype = xltypeStr;
-			size_t wlen = utf8::wcslen(str, len);
-			X::val.str = new wchar_t[wlen + 1];
-			utf8::mbstowcs(X::val.str + 1, (int)wlen, str, len);
-			X::val.str[0] = (wchar_t)wlen - 1;
+			size_t n = len < 0 ? std::strlen(str) : static_cast<size_t>(len);
+			size_t wn = std::min(utf8::decode_max(n), traits<X>::str_max - 1);
+
+			ensure(utf8::decode_counted(str, n, str_alloc(wn), wn));
 		}
 #endif
 		template<is_char T>
@@ -246,6 +448,86 @@ namespace xll {
 		}
 
 		// Multi
+		// r x c Multi of Nil with extra bytes reserved for strings added using set().
+		XOPER(xrw r, xcol c, size_t extra = 0, std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+			: X{ .xltype = xltypeNil }
+		{
+			multi_alloc(r, c, extra, mr);
+		}
+		// Block bytes to reserve for a string of length len.
+		static constexpr size_t str_bytes(size_t len)
+		{
+			return len > sso_max ? xblock::packed((len + 1) * sizeof(xchar)) : 0;
+		}
+		// Copy x into element i using space reserved in the block if possible.
+		XOPER& set(size_t i, const X& x)
+		{
+			ensure(i < cells());
+
+			cell(i)._XOPER();
+			place(i, x);
+
+			return cell(i);
+		}
+		// Counted buffer for a string of length len in element i. Use space in the cell,
+		// then space reserved in the block, then the heap. The count may be lowered later.
+		xchar* set_str(size_t i, size_t len)
+		{
+			ensure(i < cells());
+			ensure(len < traits<X>::str_max);
+
+			XOPER& c = cell(i);
+			c._XOPER();
+			if (len > sso_max) {
+				xchar* str = static_cast<xchar*>(xblock::pack(val.array.lparray, (len + 1) * sizeof(xchar)));
+				if (str) {
+					c.xltype = xltypeStr;
+					c.val.str = str;
+					str[0] = static_cast<xchar>(len);
+
+					return str;
+				}
+			}
+
+			return c.str_alloc(len, resource());
+		}
+		// Resource that allocated the Multi block, otherwise the default.
+		std::pmr::memory_resource* resource() const
+		{
+			std::pmr::memory_resource* mr = X::xltype == xltypeMulti ? xblock::owner(val.array.lparray) : nullptr;
+
+			return mr ? mr : std::pmr::get_default_resource();
+		}
+		// Resize keeping elements in row-major order. Scalars become the first element.
+		XOPER& resize(xrw r, xcol c)
+		{
+			std::pmr::memory_resource* mr = resource();
+
+			XOPER o;
+			if (X::xltype == xltypeMulti) {
+				o.multi_copy(r, c, val.array.lparray, std::min(cells(), (size_t)r * c), mr);
+			}
+			else if (xll::type(*this) == xltypeNil || xll::type(*this) == xltypeMissing) {
+				o.multi_alloc(r, c, 0, mr);
+			}
+			else {
+				o.multi_copy(r, c, this, std::min<size_t>(1, (size_t)r * c), mr);
+			}
+			swap(o);
+
+			return *this;
+		}
+		// Change dimensions without reallocating.
+		XOPER& reshape(xrw r, xcol c)
+		{
+			ensure(X::xltype == xltypeMulti);
+			ensure((size_t)r * c == cells());
+
+			val.array.rows = r;
+			val.array.columns = c;
+
+			return *this;
+		}
 		XOPER& operator[](int i)
 		{
 			return index(*this, i);
@@ -279,6 +561,105 @@ namespace xll {
 
 #ifdef _DEBUG
 	//inline constexpr int i = 1;
+	inline void test_oper_sso()
+	{
+		{
+			OPER12 o(1, L"a");
+			ensure(o.is_sso());
+			ensure(o == L"a");
+			OPER12 o2(o);
+			ensure(o2.is_sso());
+			ensure(o2.val.str != o.val.str);
+			OPER12 o3(std::move(o2));
+			ensure(o3.is_sso());
+			ensure(o3 == L"a");
+			ensure(o2.xltype == xltypeNil);
+		}
+		{
+			OPER12 o(L"a string too long to fit");
+			ensure(!o.is_sso());
+			OPER12 o2(L"ab");
+			o2 = std::move(o);
+			ensure(!o2.is_sso());
+			ensure(o.is_sso());
+			ensure(o == L"ab");
+		}
+	}
+	inline void test_oper_utf8()
+	{
+		{
+			OPER12 o("abc");
+			ensure(o == L"abc");
+		}
+		{
+			OPER12 o("\xE2\x82\xAC and more than a few characters", 3);
+			ensure(o.val.str[0] == 1);
+			ensure(o.val.str[1] == 0x20AC);
+		}
+	}
+	inline void test_oper_multi()
+	{
+		{
+			OPER12 m(2, 3);
+			ensure(m.xltype == xltypeMulti);
+			ensure(m.size() == 6);
+			ensure(m[0].xltype == xltypeNil);
+			m[1] = OPER12(1.23);
+			m.set(2, OPER12(L"a string longer than inline"));
+			ensure(m[2] == L"a string longer than inline");
+			ensure(xblock::owner(m[2].val.str) != nullptr); // no room reserved
+			m.reshape(3, 2);
+			ensure(m(1, 0) == L"a string longer than inline");
+		}
+		{
+			OPER12 s(L"a string longer than inline");
+			OPER12 m(1, 2, OPER12::str_bytes(s.val.str[0]));
+			m.set(0, s);
+			ensure(xblock::owner(m[0].val.str) == nullptr); // packed in block
+			m.set(1, OPER12(L"ab"));
+			ensure(m[1].is_sso());
+
+			OPER12 m2(m);
+			ensure(m2 == m);
+			ensure(xblock::owner(m2[0].val.str) == nullptr);
+			ensure(xblock::header(m2.val.array.lparray)->used == xblock::header(m2.val.array.lparray)->bytes);
+
+			m2.resize(2, 2);
+			ensure(m2[0] == s);
+			ensure(m2[1] == L"ab");
+			ensure(m2[3].xltype == xltypeNil);
+			m2.resize(1, 1);
+			ensure(m2.size() == 1);
+		}
+		{
+			OPER12 s(L"a string longer than inline");
+			OPER12 m0(1, 2, OPER12::str_bytes(s.val.str[0]));
+			m0.set(0, s);
+			OPER12 t, u(L"another string longer than inline");
+			{
+				OPER12 m(m0);
+				ensure(xblock::owner(m[0].val.str) == nullptr);
+				t = std::move(m[0]);
+				m[0] = std::move(u); // packed target
+				ensure(u.xltype == xltypeNil);
+			}
+			ensure(xblock::owner(t.val.str) != nullptr);
+			ensure(t == s);
+			{
+				OPER12 m(m0);
+				OPER12 v = std::move(m[0]);
+				m = OPER12();
+				ensure(v == s);
+			}
+		}
+		{
+			std::pmr::monotonic_buffer_resource mr;
+			OPER12 m(OPER12(2, 2), &mr);
+			ensure(xblock::owner(m.val.array.lparray) == &mr);
+			m.set(0, OPER12(L"a string longer than inline"));
+			ensure(xblock::owner(m[0].val.str) == &mr);
+		}
+	}
 #endif // _DEBUG
 
 
@@ -0,0 +1,762 @@
+// serial.h - binary forms of XLOPER12 values
+// The FILE form is portable: strings are UTF-16 and references are written as their first area.
+// The packed form is read in place without deserializing.
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ranges>
+#include <type_traits>
+#include <vector>
+#include "oper.h"
+#include "win_mem_view.h"
+
+namespace xll::serial {
+
+	inline void write(std::FILE* fp, const void* p, size_t n)
+	{
+		ensure(n == std::fwrite(p, 1, n, fp));
+	}
+	template<class T>
+		requires (std::is_trivially_copyable_v<T> && !std::is_base_of_v<XLOPER12, T>)
+	inline void write(std::FILE* fp, T t)
+	{
+		write(fp, &t, sizeof(t));
+	}
+	inline void write(std::FILE* fp, const XLOPER12& x)
+	{
+		write(fp, static_cast<uint32_t>(x.xltype == xltypeRef ? xltypeSRef : type(x)));
+
+		switch (type(x)) {
+		case xltypeNum:
+			write(fp, x.val.num);
+			break;
+		case xltypeStr:
+			if constexpr (sizeof(XCHAR) == sizeof(uint16_t)) {
+				write(fp, x.val.str, (x.val.str[0] + 1) * sizeof(XCHAR));
+			}
+			else {
+				std::vector<uint16_t> s(x.val.str, x.val.str + x.val.str[0] + 1);
+				write(fp, s.data(), s.size() * sizeof(uint16_t));
+			}
+			break;
+		case xltypeBool:
+			write(fp, static_cast<int32_t>(x.val.xbool));
+			break;
+		case xltypeErr:
+			write(fp, static_cast<int32_t>(x.val.err));
+			break;
+		case xltypeInt:
+			write(fp, static_cast<int32_t>(x.val.w));
+			break;
+		case xltypeSRef:
+		case xltypeRef: {
+			const XLREF12& r = type(x) == xltypeSRef ? x.val.sref.ref : x.val.mref.lpmref->reftbl[0];
+			write(fp, r);
+			break;
+		}
+		case xltypeMulti:
+			write(fp, static_cast<int32_t>(x.val.array.rows));
+			write(fp, static_cast<int32_t>(x.val.array.columns));
+			for (int i = 0; i < x.val.array.rows * x.val.array.columns; ++i) {
+				write(fp, x.val.array.lparray[i]);
+			}
+			break;
+		}
+	}
+
+	inline void read(std::FILE* fp, void* p, size_t n)
+	{
+		ensure(n == std::fread(p, 1, n, fp));
+	}
+	template<class T>
+	inline T read(std::FILE* fp)
+	{
+		T t;
+		read(fp, &t, sizeof(t));
+
+		return t;
+	}
+	inline OPER12 read_oper(std::FILE* fp)
+	{
+		OPER12 o;
+		XLOPER12 x = { .xltype = read<uint32_t>(fp) };
+
+		switch (x.xltype) {
+		case xltypeNum:
+			x.val.num = read<double>(fp);
+			break;
+		case xltypeStr: {
+			uint16_t len = read<uint16_t>(fp);
+			XCHAR* s = o.str_alloc(len);
+			if constexpr (sizeof(XCHAR) == sizeof(uint16_t)) {
+				read(fp, s + 1, len * sizeof(XCHAR));
+			}
+			else {
+				std::vector<uint16_t> t(len);
+				read(fp, t.data(), len * sizeof(uint16_t));
+				std::copy(t.begin(), t.end(), s + 1);
+			}
+			return o;
+		}
+		case xltypeBool:
+			x.val.xbool = read<int32_t>(fp);
+			break;
+		case xltypeErr:
+			x.val.err = read<int32_t>(fp);
+			break;
+		case xltypeInt:
+			x.val.w = read<int32_t>(fp);
+			break;
+		case xltypeSRef:
+			x.val.sref.count = 1;
+			x.val.sref.ref = read<XLREF12>(fp);
+			break;
+		case xltypeMulti: {
+			INT32 r = read<int32_t>(fp);
+			INT32 c = read<int32_t>(fp);
+			o = OPER12(r, c);
+			for (int i = 0; i < r * c; ++i) {
+				o[i] = read_oper(fp);
+			}
+			return o;
+		}
+		case xltypeMissing:
+		case xltypeNil:
+			break;
+		default:
+			ensure(!"serial: unknown type");
+		}
+
+		return OPER12(x);
+	}
+
+	// Packed form read in place. A value is a 16 byte cell. Strings, references,
+	// and Multi cells follow at offsets relative to the cell so a packed buffer
+	// can be mapped at any address. Strings are counted XCHAR arrays that
+	// XLOPER12 values point into directly.
+	struct cell {
+		uint16_t xltype;
+		uint16_t columns; // Multi
+		uint32_t n;       // Str length, Multi rows, Ref count, BigData bytes, or Bool/Err/Int value
+		union {
+			double num;
+			int64_t off;  // Str, SRef, Ref, Multi, BigData payload from this cell
+		};
+
+		const void* payload() const
+		{
+			return reinterpret_cast<const char*>(this) + off;
+		}
+	};
+	static_assert(sizeof(cell) == 16);
+
+	namespace detail {
+
+		constexpr size_t align(size_t n)
+		{
+			return (n + 7) & ~size_t(7);
+		}
+
+		// Payload bytes after the cell of x.
+		inline size_t tail_size(const XLOPER12& x)
+		{
+			switch (type(x)) {
+			case xltypeStr:
+				return align((x.val.str[0] + 1) * sizeof(XCHAR));
+			case xltypeSRef:
+				return align(sizeof(XLREF12));
+			case xltypeBigData:
+				return align(x.val.bigdata.cbData);
+			case xltypeRef:
+				return align(sizeof(IDSHEET) + offsetof(XLMREF12, reftbl) + x.val.mref.lpmref->count * sizeof(XLREF12));
+			case xltypeMulti: {
+				size_t n = (size_t)x.val.array.rows * x.val.array.columns;
+				size_t bytes = n * sizeof(cell);
+				for (size_t i = 0; i < n; ++i) {
+					bytes += tail_size(x.val.array.lparray[i]);
+				}
+				return bytes;
+			}
+			}
+
+			return 0;
+		}
+
+		// Write x to c and its payload at tail.
+		inline void pack(const XLOPER12& x, cell* c, char*& tail)
+		{
+			c->xltype = static_cast<uint16_t>(type(x));
+			c->columns = 0;
+			c->n = 0;
+			c->off = 0;
+			auto place = [c, &tail](size_t bytes) {
+				char* p = tail;
+				c->off = p - reinterpret_cast<char*>(c);
+				tail += align(bytes);
+				std::memset(p + bytes, 0, align(bytes) - bytes); // equal values pack to equal bytes
+				return p;
+			};
+
+			switch (type(x)) {
+			case xltypeNum:
+				c->num = x.val.num;
+				break;
+			case xltypeBool:
+				c->n = x.val.xbool;
+				break;
+			case xltypeErr:
+				c->n = x.val.err;
+				break;
+			case xltypeInt:
+				c->n = static_cast<uint32_t>(x.val.w);
+				break;
+			case xltypeStr:
+				c->n = x.val.str[0];
+				std::memcpy(place((x.val.str[0] + 1) * sizeof(XCHAR)), x.val.str, (x.val.str[0] + 1) * sizeof(XCHAR));
+				break;
+			case xltypeSRef:
+				std::memcpy(place(sizeof(XLREF12)), &x.val.sref.ref, sizeof(XLREF12));
+				break;
+			case xltypeBigData:
+				c->n = static_cast<uint32_t>(x.val.bigdata.cbData);
+				std::memcpy(place(x.val.bigdata.cbData), x.val.bigdata.h.lpbData, x.val.bigdata.cbData);
+				break;
+			case xltypeRef: {
+				const XLMREF12* m = x.val.mref.lpmref;
+				c->n = m->count;
+				size_t bytes = offsetof(XLMREF12, reftbl) + m->count * sizeof(XLREF12);
+				char* p = place(sizeof(IDSHEET) + bytes);
+				std::memcpy(p, &x.val.mref.idSheet, sizeof(IDSHEET));
+				std::memcpy(p + sizeof(IDSHEET), m, bytes);
+				break;
+			}
+			case xltypeMulti: {
+				c->n = x.val.array.rows;
+				c->columns = static_cast<uint16_t>(x.val.array.columns);
+				size_t n = (size_t)x.val.array.rows * x.val.array.columns;
+				cell* cs = reinterpret_cast<cell*>(place(n * sizeof(cell)));
+				for (size_t i = 0; i < n; ++i) {
+					pack(x.val.array.lparray[i], cs + i, tail);
+				}
+				break;
+			}
+			case xltypeMissing:
+			case xltypeNil:
+				break;
+			default:
+				ensure(!"serial: type cannot be packed");
+			}
+		}
+
+		// Nesting of Multi values accepted by validate.
+		constexpr size_t depth_max = 64;
+
+		// Check that the payload of c is at tail, where pack puts it, and ends
+		// before end, then advance tail past it. Payloads are laid out depth first
+		// in cell order, so every byte is visited once and offsets cannot loop.
+		inline void check(const cell& c, const char*& tail, const char* end, size_t depth)
+		{
+			auto place = [&c, &tail, end](size_t bytes) {
+				ensure(c.off == tail - reinterpret_cast<const char*>(&c));
+				ensure(bytes <= static_cast<size_t>(end - tail) && align(bytes) <= static_cast<size_t>(end - tail));
+				const char* p = tail;
+				tail += align(bytes);
+
+				return p;
+			};
+
+			switch (c.xltype) {
+			case xltypeNum:
+			case xltypeBool:
+			case xltypeErr:
+			case xltypeInt:
+			case xltypeMissing:
+			case xltypeNil:
+				break;
+			case xltypeStr: {
+				ensure(c.n < traits<XLOPER12>::str_max);
+				const char* p = place((c.n + 1) * sizeof(XCHAR));
+				XCHAR n;
+				std::memcpy(&n, p, sizeof(n));
+				ensure(n == c.n);
+				break;
+			}
+			case xltypeSRef:
+				place(sizeof(XLREF12));
+				break;
+			case xltypeBigData:
+				place(c.n);
+				break;
+			case xltypeRef: {
+				const char* p = place(sizeof(IDSHEET) + offsetof(XLMREF12, reftbl) + c.n * sizeof(XLREF12));
+				WORD count;
+				std::memcpy(&count, p + sizeof(IDSHEET) + offsetof(XLMREF12, count), sizeof(count));
+				ensure(count == c.n);
+				break;
+			}
+			case xltypeMulti: {
+				ensure(depth < depth_max);
+				ensure(c.n <= traits<XLOPER12>::rw_max && c.columns <= traits<XLOPER12>::col_max);
+				size_t n = (size_t)c.n * c.columns;
+				ensure(n <= static_cast<size_t>(end - tail) / sizeof(cell));
+				const cell* cs = reinterpret_cast<const cell*>(place(n * sizeof(cell)));
+				for (size_t i = 0; i < n; ++i) {
+					check(cs[i], tail, end, depth + 1);
+				}
+				break;
+			}
+			default:
+				ensure(!"serial: unknown type");
+			}
+		}
+
+	} // namespace detail
+
+	// Check that the packed value at p lies in [p, p + size) and is laid out the
+	// way pack and writer lay it out. Return its packed size or throw.
+	// Call this before viewing bytes that came from outside the process.
+	inline size_t validate(const void* p, size_t size)
+	{
+		ensure(p && reinterpret_cast<uintptr_t>(p) % alignof(cell) == 0);
+		ensure(size >= sizeof(cell));
+		const char* b = static_cast<const char*>(p);
+		const char* tail = b + sizeof(cell);
+		detail::check(*static_cast<const cell*>(p), tail, b + size, 0);
+
+		return tail - b;
+	}
+
+	// Bytes needed to pack x.
+	inline size_t packed_size(const XLOPER12& x)
+	{
+		return sizeof(cell) + detail::tail_size(x);
+	}
+
+	// Pack x into packed_size(x) bytes at p aligned to 8. Return bytes written.
+	inline size_t pack(const XLOPER12& x, void* p)
+	{
+		ensure(reinterpret_cast<uintptr_t>(p) % alignof(cell) == 0);
+		char* tail = static_cast<char*>(p) + sizeof(cell);
+		detail::pack(x, static_cast<cell*>(p), tail);
+
+		return tail - static_cast<char*>(p);
+	}
+
+	// Read-only view of a packed value. Accessors do not check bounds, so bytes
+	// from a file, pipe, or shared memory should be viewed with view(p, size).
+	class view {
+		const cell* c;
+	public:
+		// Value packed by this process.
+		explicit view(const void* p)
+			: c(static_cast<const cell*>(p))
+		{ }
+		// Value in the size bytes at p. Throws if it does not validate.
+		view(const void* p, size_t size)
+			: c(static_cast<const cell*>(p))
+		{
+			validate(p, size);
+		}
+
+		DWORD xltype() const
+		{
+			return c->xltype;
+		}
+		INT32 rows() const
+		{
+			return c->xltype == xltypeMulti ? static_cast<INT32>(c->n) : 1;
+		}
+		INT32 columns() const
+		{
+			return c->xltype == xltypeMulti ? c->columns : 1;
+		}
+		size_t size() const
+		{
+			return (size_t)rows() * columns();
+		}
+		// Element i of a Multi.
+		view operator[](size_t i) const
+		{
+			ensure(c->xltype == xltypeMulti && i < size());
+
+			return view(static_cast<const cell*>(c->payload()) + i);
+		}
+		view operator()(INT32 i, INT32 j) const
+		{
+			return operator[]((size_t)i * columns() + j);
+		}
+
+		// Non-Multi value. Strings, references, and binary data point into the packed buffer.
+		XLOPER12 value() const
+		{
+			XLOPER12 x = { .xltype = c->xltype };
+
+			switch (c->xltype) {
+			case xltypeNum:
+				x.val.num = c->num;
+				break;
+			case xltypeBool:
+				x.val.xbool = static_cast<BOOL>(c->n);
+				break;
+			case xltypeErr:
+				x.val.err = static_cast<int>(c->n);
+				break;
+			case xltypeInt:
+				x.val.w = static_cast<int>(c->n);
+				break;
+			case xltypeStr:
+				x.val.str = const_cast<XCHAR*>(static_cast<const XCHAR*>(c->payload()));
+				break;
+			case xltypeSRef:
+				x.val.sref.count = 1;
+				std::memcpy(&x.val.sref.ref, c->payload(), sizeof(XLREF12));
+				break;
+			case xltypeBigData:
+				x.val.bigdata.h.lpbData = const_cast<BYTE*>(static_cast<const BYTE*>(c->payload()));
+				x.val.bigdata.cbData = static_cast<long>(c->n);
+				break;
+			case xltypeRef: {
+				const char* p = static_cast<const char*>(c->payload());
+				std::memcpy(&x.val.mref.idSheet, p, sizeof(IDSHEET));
+				x.val.mref.lpmref = reinterpret_cast<LPXLMREF12>(const_cast<char*>(p + sizeof(IDSHEET)));
+				break;
+			}
+			case xltypeMulti:
+				ensure(!"serial: use operator[] for Multi");
+			}
+
+			return x;
+		}
+
+		// Cells of a Multi as views, e.g. for (view x : v.values()) use x.value(),
+		// or x[i] if x is itself a Multi.
+		auto values() const
+		{
+			return std::views::iota(size_t(0), size())
+				| std::views::transform([v = *this](size_t i) { return v[i]; });
+		}
+
+		// Copy into an OPER12.
+		OPER12 oper() const
+		{
+			if (c->xltype != xltypeMulti) {
+				return OPER12(value());
+			}
+
+			size_t extra = 0;
+			for (size_t i = 0; i < size(); ++i) {
+				const view v = operator[](i);
+				if (v.xltype() == xltypeStr) {
+					extra += OPER12::str_bytes(v.c->n);
+				}
+			}
+			OPER12 o(rows(), columns(), extra);
+			for (size_t i = 0; i < size(); ++i) {
+				const view v = operator[](i);
+				if (v.xltype() == xltypeMulti) {
+					o[i] = v.oper();
+				}
+				else {
+					o.set(i, v.value());
+				}
+			}
+
+			return o;
+		}
+	};
+
+	// Stream of packed values in a mapped buffer. Each value is preceded by its
+	// size so a reader can step through them without looking inside.
+	struct stream_header {
+		static constexpr uint32_t magic = 0x504C4C58; // XLLP
+		static constexpr uint16_t format = 1;
+
+		uint32_t id = magic;
+		uint16_t version = format;
+		uint16_t xchar = sizeof(XCHAR);
+	};
+	static_assert(sizeof(stream_header) == 8);
+
+	// Append values to a stream. Cells of a Multi can be written one at a time
+	// between begin() and end() so large tables are never built in memory.
+	// Every cell must be written before end().
+	class writer {
+		struct frame {
+			size_t cells; // offset of the cell array
+			size_t n;     // number of cells
+			size_t i;     // next cell
+		};
+		Win::mem_view<std::byte>& buf;
+		std::vector<frame> open;
+		size_t start = 0; // offset of the size of the current value
+
+		cell* at(size_t offset)
+		{
+			return reinterpret_cast<cell*>(buf.data() + offset);
+		}
+		// Offset of the cell for the next value.
+		size_t slot()
+		{
+			if (open.empty()) {
+				start = buf.size();
+				buf.reset(start + sizeof(uint64_t) + sizeof(cell));
+
+				return start + sizeof(uint64_t);
+			}
+
+			frame& f = open.back();
+			ensure(f.i < f.n);
+
+			return f.cells + sizeof(cell) * f.i++;
+		}
+		// Record the size of a completed top level value.
+		void done()
+		{
+			if (open.empty()) {
+				uint64_t bytes = buf.size() - start - sizeof(uint64_t);
+				std::memcpy(buf.data() + start, &bytes, sizeof(bytes));
+			}
+		}
+	public:
+		explicit writer(Win::mem_view<std::byte>& buf)
+			: buf(buf)
+		{
+			if (buf.size() == 0) {
+				stream_header h;
+				buf.append(reinterpret_cast<const std::byte*>(&h), sizeof(h));
+			}
+			ensure(buf.size() % alignof(cell) == 0);
+		}
+		writer(const writer&) = delete;
+		writer& operator=(const writer&) = delete;
+
+		// Write x as the next value.
+		writer& put(const XLOPER12& x)
+		{
+			size_t s = slot();
+			size_t t = buf.size();
+			buf.reset(t + detail::tail_size(x));
+			char* tail = reinterpret_cast<char*>(buf.data() + t);
+			detail::pack(x, at(s), tail);
+			done();
+
+			return *this;
+		}
+		writer& operator<<(const XLOPER12& x)
+		{
+			return put(x);
+		}
+
+		// Start an r x c Multi as the next value.
+		writer& begin(INT32 r, INT32 c)
+		{
+			ensure(r >= 0 && (size_t)r <= traits<XLOPER12>::rw_max);
+			ensure(c >= 0 && (size_t)c <= traits<XLOPER12>::col_max);
+
+			size_t s = slot();
+			size_t t = buf.size();
+			size_t n = (size_t)r * c;
+			buf.reset(t + n * sizeof(cell));
+			cell* p = at(s);
+			p->xltype = xltypeMulti;
+			p->columns = static_cast<uint16_t>(c);
+			p->n = static_cast<uint32_t>(r);
+			p->off = static_cast<int64_t>(t - s);
+			for (size_t i = 0; i < n; ++i) {
+				*at(t + i * sizeof(cell)) = cell{ .xltype = xltypeNil, .columns = 0, .n = 0, .off = 0 };
+			}
+			open.push_back(frame{ t, n, 0 });
+
+			return *this;
+		}
+		writer& end()
+		{
+			ensure(!open.empty());
+			ensure(open.back().i == open.back().n || !"serial: Multi cells not written");
+			open.pop_back();
+			done();
+
+			return *this;
+		}
+	};
+
+	// Step through the values of a stream, e.g. a mapped file written by writer.
+	// Each value is validated before it is returned.
+	class reader {
+		const std::byte* p;
+		const std::byte* e;
+	public:
+		reader(const void* data, size_t size)
+			: p(static_cast<const std::byte*>(data)), e(p + size)
+		{
+			stream_header h;
+			ensure(size >= sizeof(h));
+			std::memcpy(&h, p, sizeof(h));
+			ensure(h.id == stream_header::magic && h.version == stream_header::format && h.xchar == sizeof(XCHAR));
+			p += sizeof(h);
+		}
+
+		explicit operator bool() const
+		{
+			return p < e;
+		}
+		view next()
+		{
+			uint64_t bytes;
+			ensure(e - p >= static_cast<std::ptrdiff_t>(sizeof(bytes)));
+			std::memcpy(&bytes, p, sizeof(bytes));
+			p += sizeof(bytes);
+			ensure(bytes >= sizeof(cell) && bytes <= static_cast<uint64_t>(e - p));
+			ensure(bytes == validate(p, static_cast<size_t>(bytes)));
+			view v(p);
+			p += bytes;
+
+			return v;
+		}
+	};
+
+#ifdef _DEBUG
+	inline void test_serial()
+	{
+		std::FILE* fp = std::tmpfile();
+		OPER12 m(2, 2);
+		m[0] = OPER12(1.5);
+		m[1] = OPER12(L"a string longer than inline");
+		m[2] = OPER12(true);
+		m[3] = OPER12(XlErr::NA);
+		write(fp, m);
+		write(fp, OPER12(L""));
+		std::rewind(fp);
+		ensure(read_oper(fp) == m);
+		ensure(read_oper(fp) == OPER12(L""));
+		std::fclose(fp);
+
+		OPER12 n(1, 2);
+		n[0] = m;
+		n[1] = OPER12(L"abc");
+		OPER12 num(2.5), empty(L""), nil;
+		for (const OPER12* px : { &m, &n, &num, &empty, &nil }) {
+			const OPER12& x = *px;
+			std::vector<uint64_t> buf(packed_size(x) / sizeof(uint64_t));
+			ensure(buf.size() * sizeof(uint64_t) == pack(x, buf.data()));
+			view v(buf.data());
+			ensure(v.xltype() == type(x));
+			ensure(v.oper() == x);
+		}
+		{
+			std::vector<uint64_t> buf(packed_size(m) / sizeof(uint64_t));
+			pack(m, buf.data());
+			view v(buf.data());
+			ensure(v.rows() == 2 && v.columns() == 2);
+			XLOPER12 s = v[1].value();
+			ensure(reinterpret_cast<const char*>(s.val.str) > reinterpret_cast<const char*>(buf.data()));
+			ensure(OPER12(s) == m[1]);
+			ensure(v(1, 1).value().val.err == xlerrNA);
+			size_t i = 0;
+			for (view x : v.values()) {
+				ensure(OPER12(x.value()) == m[i++]);
+			}
+			ensure(i == 4);
+			ensure(validate(buf.data(), buf.size() * sizeof(uint64_t)) == buf.size() * sizeof(uint64_t));
+		}
+		{
+			// nested Multi cells are views
+			std::vector<uint64_t> buf(packed_size(n) / sizeof(uint64_t));
+			pack(n, buf.data());
+			view v(buf.data(), buf.size() * sizeof(uint64_t));
+			size_t i = 0;
+			for (view x : v.values()) {
+				ensure(x.oper() == n[i++]);
+			}
+			ensure(v.values().front().xltype() == xltypeMulti);
+		}
+		{
+			// bad bytes are rejected before they are read
+			auto rejects = [](std::vector<uint64_t> buf, size_t size) {
+				try {
+					validate(buf.data(), size);
+				}
+				catch (const std::exception&) {
+					return true;
+				}
+				return false;
+			};
+			std::vector<uint64_t> buf(packed_size(n) / sizeof(uint64_t));
+			size_t size = buf.size() * sizeof(uint64_t);
+			pack(n, buf.data());
+			ensure(!rejects(buf, size));
+			ensure(rejects(buf, size - 8)); // truncated
+			ensure(rejects(buf, sizeof(cell) - 1));
+
+			auto at = [](std::vector<uint64_t>& b, size_t i) { return reinterpret_cast<cell*>(b.data()) + i; };
+			auto bad = buf;
+			at(bad, 0)->off += 16; // Multi cells not where they belong
+			ensure(rejects(bad, size));
+			bad = buf;
+			at(bad, 0)->off = -16; // before the buffer
+			ensure(rejects(bad, size));
+			bad = buf;
+			at(bad, 0)->n = 0x7FFFFFFF; // rows
+			ensure(rejects(bad, size));
+			bad = buf;
+			at(bad, 2)->n += 1; // string length, cell 1 of n
+			ensure(rejects(bad, size));
+			bad = buf;
+			at(bad, 2)->xltype = 0x7FFF;
+			ensure(rejects(bad, size));
+
+			// a Multi containing itself
+			std::vector<uint64_t> loop(4);
+			*at(loop, 0) = cell{ .xltype = xltypeMulti, .columns = 1, .n = 1, .off = 16 };
+			*at(loop, 1) = cell{ .xltype = xltypeMulti, .columns = 1, .n = 1, .off = 0 };
+			ensure(rejects(loop, 32));
+		}
+		{
+			Win::mem_view<std::byte> buf;
+			{
+				writer w(buf);
+				w << m << OPER12(L"abc");
+				w.begin(2, 3);
+				for (int j = 0; j < 4; ++j) {
+					w << OPER12(static_cast<double>(j));
+				}
+				w.begin(1, 1).put(OPER12(L"a string longer than inline")).end();
+				w << OPER12();
+				w.end();
+				BYTE data[] = { 1, 2, 3 };
+				XLOPER12 b = { .xltype = xltypeBigData };
+				b.val.bigdata.h.lpbData = data;
+				b.val.bigdata.cbData = 3;
+				w << b;
+			}
+			reader r(buf.data(), buf.size());
+			ensure(r.next().oper() == m);
+			ensure(r.next().oper() == L"abc");
+			view t = r.next();
+			ensure(t.rows() == 2 && t.columns() == 3);
+			ensure(t(1, 0).value().val.num == 3);
+			ensure(t(1, 1).rows() == 1 && t(1, 1)[0].oper() == L"a string longer than inline");
+			ensure(t(1, 2).xltype() == xltypeNil);
+			XLOPER12 b = r.next().value();
+			ensure(b.xltype == xltypeBigData && b.val.bigdata.cbData == 3 && b.val.bigdata.h.lpbData[2] == 3);
+			ensure(!r);
+		}
+		{
+			Win::mem_view<std::byte> buf;
+			writer w(buf);
+			bool thrown = false;
+			try {
+				w.begin(1, 2).put(OPER12(1.)).end();
+			}
+			catch (const std::exception&) {
+				thrown = true;
+			}
+			ensure(thrown);
+		}
+	}
+#endif // _DEBUG
+
+} // namespace xll::serial
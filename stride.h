@@ -0,0 +1,175 @@
+// stride.h - non-owning strided access to contiguous arrays
+#pragma once
+#include <cstddef>
+#include <iterator>
+#include "ensure.h"
+
+namespace xll {
+
+	// Random access iterator that advances by a fixed stride.
+	// Position is an index from the base so end() never points past the array.
+	template<class T>
+	class stride_iterator {
+		T* p;
+		std::ptrdiff_t i;
+		std::ptrdiff_t s;
+	public:
+		using iterator_concept = std::random_access_iterator_tag;
+		using iterator_category = std::random_access_iterator_tag;
+		using value_type = std::remove_cv_t<T>;
+		using difference_type = std::ptrdiff_t;
+		using pointer = T*;
+		using reference = T&;
+
+		constexpr stride_iterator(T* p = nullptr, std::ptrdiff_t i = 0, std::ptrdiff_t s = 1) noexcept
+			: p(p), i(i), s(s)
+		{ }
+
+		constexpr bool operator==(const stride_iterator& j) const noexcept
+		{
+			return i == j.i;
+		}
+		constexpr auto operator<=>(const stride_iterator& j) const noexcept
+		{
+			return i <=> j.i;
+		}
+
+		constexpr T& operator*() const noexcept
+		{
+			return p[i * s];
+		}
+		constexpr T* operator->() const noexcept
+		{
+			return p + i * s;
+		}
+		constexpr T& operator[](difference_type n) const noexcept
+		{
+			return p[(i + n) * s];
+		}
+
+		constexpr stride_iterator& operator++() noexcept
+		{
+			++i;
+
+			return *this;
+		}
+		constexpr stride_iterator operator++(int) noexcept
+		{
+			auto j = *this;
+			++*this;
+
+			return j;
+		}
+		constexpr stride_iterator& operator--() noexcept
+		{
+			--i;
+
+			return *this;
+		}
+		constexpr stride_iterator operator--(int) noexcept
+		{
+			auto j = *this;
+			--*this;
+
+			return j;
+		}
+		constexpr stride_iterator& operator+=(difference_type n) noexcept
+		{
+			i += n;
+
+			return *this;
+		}
+		constexpr stride_iterator& operator-=(difference_type n) noexcept
+		{
+			i -= n;
+
+			return *this;
+		}
+		constexpr stride_iterator operator+(difference_type n) const noexcept
+		{
+			return stride_iterator(p, i + n, s);
+		}
+		friend constexpr stride_iterator operator+(difference_type n, const stride_iterator& j) noexcept
+		{
+			return j + n;
+		}
+		constexpr stride_iterator operator-(difference_type n) const noexcept
+		{
+			return stride_iterator(p, i - n, s);
+		}
+		constexpr difference_type operator-(const stride_iterator& j) const noexcept
+		{
+			return i - j.i;
+		}
+	};
+
+	// n elements starting at p separated by stride s.
+	template<class T>
+	class stride_span {
+		T* p;
+		std::size_t n;
+		std::ptrdiff_t s;
+	public:
+		using value_type = std::remove_cv_t<T>;
+		using iterator = stride_iterator<T>;
+
+		constexpr stride_span(T* p = nullptr, std::size_t n = 0, std::ptrdiff_t s = 1) noexcept
+			: p(p), n(n), s(s)
+		{ }
+
+		constexpr std::size_t size() const noexcept
+		{
+			return n;
+		}
+		constexpr bool empty() const noexcept
+		{
+			return n == 0;
+		}
+		constexpr std::ptrdiff_t stride() const noexcept
+		{
+			return s;
+		}
+		constexpr T& operator[](std::size_t i) const noexcept
+		{
+			return p[static_cast<std::ptrdiff_t>(i) * s];
+		}
+		constexpr iterator begin() const noexcept
+		{
+			return iterator(p, 0, s);
+		}
+		constexpr iterator end() const noexcept
+		{
+			return iterator(p, static_cast<std::ptrdiff_t>(n), s);
+		}
+	};
+
+#ifdef _DEBUG
+	inline void test_stride()
+	{
+		{
+			static_assert(std::random_access_iterator<stride_iterator<int>>);
+			static constexpr int a[] = { 0, 1, 2, 3, 4, 5 };
+			constexpr stride_span<const int> s(a, 3, 2);
+			static_assert(3 == s.size());
+			static_assert(0 == s[0]);
+			static_assert(4 == s[2]);
+			static_assert(2 == *(s.begin() + 1));
+			static_assert(2 == s.end() - (s.begin() + 1));
+			static_assert(4 == *(s.end() - 1));
+		}
+		{
+			// last column of the last row: end is one stride past the array
+			static constexpr int a[] = { 0, 1, 2, 3, 4, 5 };
+			constexpr stride_span<const int> s(a + 2, 2, 3);
+			static_assert(5 == s.end()[-1]);
+			static_assert(2 == s.end() - s.begin());
+			int n = 0;
+			for (int x : s) {
+				n += x;
+			}
+			ensure(n == 7);
+		}
+	}
+#endif // _DEBUG
+
+} // namespace xll
@@ -0,0 +1,82 @@
+// test.cpp - run the _DEBUG tests and XLL_BENCH benchmarks without Excel
+#include <cstdio>
+#include <cstring>
+#include "xll.h"
+#include "async.h"
+#include "bench.h"
+#include "cache.h"
+#include "cluster.h"
+#include "convert.h"
+#include "hash.h"
+#include "host.h"
+#include "instrument.h"
+#include "multi.h"
+#include "serial.h"
+#include "view.h"
+#include "win_mem_view.h"
+#include "xlregister.h"
+#include "xlset.h"
+
+using namespace xll;
+
+int main(int argc, char* argv[])
+{
+	if (argc > 1 && 0 == std::strcmp(argv[1], cluster::worker_flag)) {
+		return cluster::serve();
+	}
+
+	try {
+#ifdef _DEBUG
+		utf8::test_utf8();
+		test_xloper_num();
+		test_xloper_str();
+		test_xloper_bool();
+		test_xloper_err();
+		test_xloper_literal();
+		test_xloper_multi();
+		test_xlref();
+		test_counted_literal();
+		test_oper_sso();
+		test_oper_utf8();
+		test_oper_multi();
+		test_stride();
+		test_fp();
+		Win::test_mem_view();
+		test_multi_utf8();
+		test_multi_classify();
+		test_hash();
+		test_cache();
+		test_view();
+		test_convert();
+		test_range_writer();
+		serial::test_serial();
+		test_host();
+		test_excel();
+		test_context();
+		test_free_queue();
+		test_free_scope();
+		test_register();
+		test_async();
+		cluster::test_cluster();
+		instrument::test_instrument();
+#endif // _DEBUG
+#ifdef XLL_BENCH
+		for (const auto& v : { bench::run(), bench::hosted() }) {
+			for (const bench::result& r : v) {
+				std::printf("%-16s %10zu %12.3e %12.3e %8.2fx", r.name, r.n, r.baseline, r.optimized, r.baseline / r.optimized);
+				if (r.baseline_calls) {
+					std::printf(" %10zu %10zu callbacks", r.baseline_calls, r.optimized_calls);
+				}
+				std::printf("\n");
+			}
+		}
+#endif // XLL_BENCH
+	}
+	catch (const std::exception& ex) {
+		std::fprintf(stderr, "%s\n", ex.what());
+
+		return 1;
+	}
+
+	return 0;
+}
@@ -2,11 +2,22 @@
 // Loss-free conversion from UTF-16 to MBCS and back
 // https://docs.microsoft.com/en-us/archive/msdn-magazine/2016/september/c-unicode-encoding-conversions-with-stl-strings-and-win32-apis
 #pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <string>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#ifdef _WIN32
 #include <Windows.h>
+#endif
+#include "ensure.h"
 
 namespace utf8 {
 
+#ifdef _WIN32
 	// Length of wcs required to convert s. Null terminated if n = -1.
 	inline int wcslen(const char* s, int n = -1)
 	{
@@ -48,4 +59,278 @@ namespace utf8 {
 
 		return s;
 	}
-}
\ No newline at end of file
+#endif // _WIN32
+
+	// Portable single pass transcoding between UTF-8 and UTF-16.
+	// W is any integral type holding UTF-16 code units, e.g. XCHAR or char16_t.
+	// Invalid input is replaced by U+FFFD like MultiByteToWideChar.
+
+	inline constexpr char32_t replacement = 0xFFFD;
+
+	// UTF-16 code units never exceed UTF-8 bytes.
+	inline constexpr size_t decode_max(size_t n)
+	{
+		return n;
+	}
+	// UTF-8 bytes never exceed three times UTF-16 code units.
+	inline constexpr size_t encode_max(size_t wn)
+	{
+		return 3 * wn;
+	}
+
+	namespace detail {
+
+		// Widen leading ASCII bytes of s into w. Return number copied.
+		template<class W>
+		inline size_t ascii(const unsigned char* s, size_t n, W* w)
+		{
+			size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+			if constexpr (sizeof(W) == 2) {
+				const __m128i zero = _mm_setzero_si128();
+				for (; i + 16 <= n; i += 16) {
+					__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+					if (_mm_movemask_epi8(b)) {
+						break;
+					}
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(w + i), _mm_unpacklo_epi8(b, zero));
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(w + i + 8), _mm_unpackhi_epi8(b, zero));
+				}
+			}
+#endif
+			for (; i + 8 <= n; i += 8) {
+				uint64_t b;
+				std::memcpy(&b, s + i, 8);
+				if (b & 0x8080808080808080ull) {
+					break;
+				}
+				for (size_t k = 0; k < 8; ++k) {
+					w[i + k] = static_cast<W>(s[i + k]);
+				}
+			}
+			for (; i < n && s[i] < 0x80; ++i) {
+				w[i] = static_cast<W>(s[i]);
+			}
+
+			return i;
+		}
+
+		// Narrow leading ASCII code units of w into s. Return number copied.
+		template<class W>
+		inline size_t ascii(const W* w, size_t n, unsigned char* s)
+		{
+			size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+			if constexpr (sizeof(W) == 2) {
+				const __m128i zero = _mm_setzero_si128();
+				const __m128i high = _mm_set1_epi16(static_cast<short>(0xFF80));
+				for (; i + 16 <= n; i += 16) {
+					__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(w + i));
+					__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(w + i + 8));
+					__m128i h = _mm_and_si128(_mm_or_si128(a, b), high);
+					if (_mm_movemask_epi8(_mm_cmpeq_epi16(h, zero)) != 0xFFFF) {
+						break;
+					}
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(s + i), _mm_packus_epi16(a, b));
+				}
+			}
+#endif
+			for (; i < n && static_cast<uint32_t>(w[i]) < 0x80; ++i) {
+				s[i] = static_cast<unsigned char>(w[i]);
+			}
+
+			return i;
+		}
+
+	} // namespace detail
+
+	// Convert n bytes of UTF-8 in s to at most wn UTF-16 code units in w.
+	// Return number of code units written or -1 if w is too small.
+	template<class W>
+	inline std::ptrdiff_t decode(const char* s_, size_t n, W* w, size_t wn)
+	{
+		static_assert(sizeof(W) >= 2);
+		const unsigned char* s = reinterpret_cast<const unsigned char*>(s_);
+		size_t i = 0, j = 0;
+
+		while (i < n) {
+			if (s[i] < 0x80) {
+				size_t k = detail::ascii(s + i, std::min(n - i, wn - j), w + j);
+				if (k == 0) {
+					return -1;
+				}
+				i += k;
+				j += k;
+
+				continue;
+			}
+
+			// lead byte determines length and minimum code point
+			char32_t c = replacement;
+			size_t len = 1;
+			unsigned char b = s[i];
+			if (b >= 0xC2 && b <= 0xDF) {
+				len = 2;
+				c = b & 0x1F;
+			}
+			else if (b >= 0xE0 && b <= 0xEF) {
+				len = 3;
+				c = b & 0x0F;
+			}
+			else if (b >= 0xF0 && b <= 0xF4) {
+				len = 4;
+				c = b & 0x07;
+			}
+
+			if (len > 1) {
+				size_t k = 1;
+				for (; k < len && i + k < n && (s[i + k] & 0xC0) == 0x80; ++k) {
+					c = (c << 6) | (s[i + k] & 0x3F);
+				}
+				if (k < len
+					|| (len == 3 && (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF)))
+					|| (len == 4 && (c < 0x10000 || c > 0x10FFFF))) {
+					// replace maximal invalid prefix
+					c = replacement;
+					len = k;
+				}
+			}
+			i += len;
+
+			if (c >= 0x10000) {
+				if (j + 2 > wn) {
+					return -1;
+				}
+				c -= 0x10000;
+				w[j++] = static_cast<W>(0xD800 + (c >> 10));
+				w[j++] = static_cast<W>(0xDC00 + (c & 0x3FF));
+			}
+			else {
+				if (j + 1 > wn) {
+					return -1;
+				}
+				w[j++] = static_cast<W>(c);
+			}
+		}
+
+		return static_cast<std::ptrdiff_t>(j);
+	}
+
+	// Convert wn UTF-16 code units in w to at most n bytes of UTF-8 in s.
+	// Return number of bytes written or -1 if s is too small.
+	template<class W>
+	inline std::ptrdiff_t encode(const W* w, size_t wn, char* s_, size_t n)
+	{
+		static_assert(sizeof(W) >= 2);
+		unsigned char* s = reinterpret_cast<unsigned char*>(s_);
+		size_t i = 0, j = 0;
+
+		while (i < wn) {
+			if (static_cast<uint32_t>(w[i]) < 0x80) {
+				size_t k = detail::ascii(w + i, std::min(wn - i, n - j), s + j);
+				if (k == 0) {
+					return -1;
+				}
+				i += k;
+				j += k;
+
+				continue;
+			}
+
+			char32_t c = static_cast<char32_t>(static_cast<uint32_t>(w[i++]) & 0xFFFF);
+			if (c >= 0xD800 && c <= 0xDBFF && i < wn
+				&& (w[i] & 0xFC00) == 0xDC00) {
+				c = 0x10000 + ((c - 0xD800) << 10) + (w[i++] - 0xDC00);
+			}
+			else if (c >= 0xD800 && c <= 0xDFFF) {
+				c = replacement; // unpaired surrogate
+			}
+
+			size_t len = c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+			if (j + len > n) {
+				return -1;
+			}
+			switch (len) {
+			case 2:
+				s[j++] = static_cast<unsigned char>(0xC0 | (c >> 6));
+				break;
+			case 3:
+				s[j++] = static_cast<unsigned char>(0xE0 | (c >> 12));
+				s[j++] = static_cast<unsigned char>(0x80 | ((c >> 6) & 0x3F));
+				break;
+			case 4:
+				s[j++] = static_cast<unsigned char>(0xF0 | (c >> 18));
+				s[j++] = static_cast<unsigned char>(0x80 | ((c >> 12) & 0x3F));
+				s[j++] = static_cast<unsigned char>(0x80 | ((c >> 6) & 0x3F));
+				break;
+			}
+			s[j++] = static_cast<unsigned char>(0x80 | (c & 0x3F));
+		}
+
+		return static_cast<std::ptrdiff_t>(j);
+	}
+
+	// Convert UTF-8 to a counted string in w having room for wn characters after the count.
+	// Return w or nullptr if w is too small.
+	template<class W>
+	inline W* decode_counted(const char* s, size_t n, W* w, size_t wn)
+	{
+		std::ptrdiff_t len = decode(s, n, w + 1, wn);
+		if (len < 0) {
+			return nullptr;
+		}
+		w[0] = static_cast<W>(len);
+
+		return w;
+	}
+
+#ifdef _DEBUG
+	inline void test_utf8()
+	{
+		{
+			const char s[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+			char16_t w[sizeof(s)];
+			char t[sizeof(s)];
+			size_t n = sizeof(s) - 1;
+			ensure(decode(s, n, w, n) == (std::ptrdiff_t)n);
+			ensure(w[35] == u'9');
+			ensure(encode(w, n, t, n) == (std::ptrdiff_t)n);
+			ensure(0 == std::memcmp(s, t, n));
+		}
+		{
+			// 2, 3 and 4 byte sequences
+			const char s[] = "a\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80z";
+			const char16_t u[] = u"a\u00E9\u20AC\U0001F600z";
+			char16_t w[16];
+			char t[16];
+			size_t n = sizeof(s) - 1;
+			std::ptrdiff_t wn = decode(s, n, w, 16);
+			ensure(wn == 6);
+			ensure(0 == std::memcmp(w, u, 6 * sizeof(char16_t)));
+			ensure(encode(w, wn, t, 16) == (std::ptrdiff_t)n);
+			ensure(0 == std::memcmp(s, t, n));
+			ensure(decode(s, n, w, 5) == -1);
+		}
+		{
+			// overlong, truncated, and surrogate sequences
+			const char s[] = "\xC0\xAF" "\xE2\x82" "\xED\xA0\x80";
+			char16_t w[16];
+			std::ptrdiff_t wn = decode(s, sizeof(s) - 1, w, 16);
+			ensure(wn == 4);
+			for (std::ptrdiff_t i = 0; i < wn; ++i) {
+				ensure(w[i] == replacement);
+			}
+			const char16_t u[] = { 0xD800, u'a' };
+			char t[8];
+			ensure(encode(u, 2, t, 8) == 4);
+			ensure(0 == std::memcmp(t, "\xEF\xBF\xBD" "a", 4));
+		}
+		{
+			char16_t w[4];
+			ensure(decode_counted("abc", 3, w, 3));
+			ensure(w[0] == 3);
+			ensure(w[3] == u'c');
+		}
+	}
+#endif // _DEBUG
+}
@@ -0,0 +1,248 @@
+// view.h - non-owning 2-d views of Multi ranges
+// Rows, columns, blocks, and transposes share the cells of the range.
+#pragma once
+#include <iterator>
+#include <ranges>
+#include "ensure.h"
+#include "stride.h"
+#include "oper.h"
+
+namespace xll {
+
+	// Cells (i, j) at p[i * rs + j * cs] for 0 <= i < r and 0 <= j < c.
+	template<class X>
+	class multi_view : public std::ranges::view_interface<multi_view<X>> {
+		X* p;
+		size_t r, c;
+		std::ptrdiff_t rs, cs;
+	public:
+		// Row-major iteration over the view. Iterators do not refer to the view.
+		class iterator {
+			multi_view v;
+			std::ptrdiff_t k;
+		public:
+			using iterator_concept = std::random_access_iterator_tag;
+			using iterator_category = std::random_access_iterator_tag;
+			using value_type = std::remove_cv_t<X>;
+			using difference_type = std::ptrdiff_t;
+			using pointer = X*;
+			using reference = X&;
+
+			constexpr iterator() noexcept
+				: v{}, k(0)
+			{ }
+			constexpr iterator(const multi_view& v, std::ptrdiff_t k) noexcept
+				: v(v), k(k)
+			{ }
+
+			constexpr bool operator==(const iterator& i) const noexcept
+			{
+				return k == i.k;
+			}
+			constexpr auto operator<=>(const iterator& i) const noexcept
+			{
+				return k <=> i.k;
+			}
+
+			constexpr X& operator*() const noexcept
+			{
+				return v.at(k);
+			}
+			constexpr X* operator->() const noexcept
+			{
+				return &v.at(k);
+			}
+			constexpr X& operator[](difference_type n) const noexcept
+			{
+				return v.at(k + n);
+			}
+
+			constexpr iterator& operator++() noexcept
+			{
+				++k;
+
+				return *this;
+			}
+			constexpr iterator operator++(int) noexcept
+			{
+				return iterator(v, k++);
+			}
+			constexpr iterator& operator--() noexcept
+			{
+				--k;
+
+				return *this;
+			}
+			constexpr iterator operator--(int) noexcept
+			{
+				return iterator(v, k--);
+			}
+			constexpr iterator& operator+=(difference_type n) noexcept
+			{
+				k += n;
+
+				return *this;
+			}
+			constexpr iterator& operator-=(difference_type n) noexcept
+			{
+				k -= n;
+
+				return *this;
+			}
+			constexpr iterator operator+(difference_type n) const noexcept
+			{
+				return iterator(v, k + n);
+			}
+			friend constexpr iterator operator+(difference_type n, const iterator& i) noexcept
+			{
+				return i + n;
+			}
+			constexpr iterator operator-(difference_type n) const noexcept
+			{
+				return iterator(v, k - n);
+			}
+			constexpr difference_type operator-(const iterator& i) const noexcept
+			{
+				return k - i.k;
+			}
+		};
+
+		constexpr multi_view() noexcept
+			: p(nullptr), r(0), c(0), rs(0), cs(0)
+		{ }
+		constexpr multi_view(X* p, size_t r, size_t c, std::ptrdiff_t rs, std::ptrdiff_t cs) noexcept
+			: p(p), r(r), c(c), rs(rs), cs(cs)
+		{ }
+		// Cells of a Multi or a scalar as 1 x 1.
+		constexpr multi_view(X& x) noexcept
+			: multi_view(&x, 1, 1, 1, 1)
+		{
+			if (type(x) == xltypeMulti) {
+				p = static_cast<X*>(x.val.array.lparray);
+				r = x.val.array.rows;
+				c = x.val.array.columns;
+				rs = x.val.array.columns;
+				cs = 1;
+			}
+		}
+
+		constexpr size_t rows() const noexcept
+		{
+			return r;
+		}
+		constexpr size_t columns() const noexcept
+		{
+			return c;
+		}
+		constexpr size_t size() const noexcept
+		{
+			return r * c;
+		}
+		// True if cells are contiguous in row-major order.
+		constexpr bool contiguous() const noexcept
+		{
+			return cs == 1 && (r <= 1 || rs == static_cast<std::ptrdiff_t>(c));
+		}
+
+		constexpr X& operator()(size_t i, size_t j) const noexcept
+		{
+			return p[static_cast<std::ptrdiff_t>(i) * rs + static_cast<std::ptrdiff_t>(j) * cs];
+		}
+		// k-th cell in row-major order.
+		constexpr X& at(std::ptrdiff_t k) const noexcept
+		{
+			return operator()(k / c, k % c);
+		}
+
+		constexpr iterator begin() const noexcept
+		{
+			return iterator(*this, 0);
+		}
+		constexpr iterator end() const noexcept
+		{
+			return iterator(*this, static_cast<std::ptrdiff_t>(size()));
+		}
+
+		constexpr stride_span<X> row(size_t i) const noexcept
+		{
+			return stride_span<X>(&operator()(i, 0), c, cs);
+		}
+		constexpr stride_span<X> column(size_t j) const noexcept
+		{
+			return stride_span<X>(&operator()(0, j), r, rs);
+		}
+		// h x w block with top left cell (i, j).
+		constexpr multi_view block(size_t i, size_t j, size_t h, size_t w) const
+		{
+			ensure(i + h <= r && j + w <= c);
+
+			return multi_view(h && w ? &operator()(i, j) : p, h, w, rs, cs);
+		}
+		constexpr multi_view transpose() const noexcept
+		{
+			return multi_view(p, c, r, cs, rs);
+		}
+	};
+
+	// Cells of XOPER are XOPER. Cells of other types are the SDK struct.
+	template<XlOper X>
+	struct cell_type {
+		using type = xloper_t<X>;
+	};
+	template<is_xloper X>
+	struct cell_type<XOPER<X>> {
+		using type = XOPER<X>;
+	};
+
+	template<XlOper X>
+	multi_view(X&) -> multi_view<typename cell_type<X>::type>;
+	template<XlOper X>
+	multi_view(const X&) -> multi_view<const typename cell_type<X>::type>;
+
+} // namespace xll
+
+// Iterators are valid after the view is destroyed.
+template<class X>
+inline constexpr bool std::ranges::enable_borrowed_range<xll::multi_view<X>> = true;
+template<class T>
+inline constexpr bool std::ranges::enable_borrowed_range<xll::stride_span<T>> = true;
+
+namespace xll {
+
+#ifdef _DEBUG
+	inline void test_view()
+	{
+		static_assert(std::ranges::random_access_range<multi_view<XLOPER12>>);
+		static_assert(std::ranges::view<multi_view<const XLOPER12>>);
+		{
+			static constexpr Multi12<2, 3> m({ Num12(0), Num12(1), Num12(2), Num12(3), Num12(4), Num12(5) });
+			constexpr multi_view v(m);
+			static_assert(2 == v.rows());
+			static_assert(3 == v.columns());
+			static_assert(v.contiguous());
+			static_assert(5 == v(1, 2).val.num);
+			static_assert(4 == v.row(1)[1].val.num);
+			static_assert(5 == v.column(2)[1].val.num);
+
+			constexpr auto t = v.transpose();
+			static_assert(3 == t.rows());
+			static_assert(!t.contiguous());
+			static_assert(3 == t(0, 1).val.num);
+			static_assert(1 == (*(t.begin() + 2)).val.num);
+
+			constexpr auto b = v.block(0, 1, 2, 2);
+			static_assert(4 == b.size());
+			static_assert(!b.contiguous());
+			static_assert(5 == b(1, 1).val.num);
+			static_assert(4 == b.transpose()(0, 1).val.num);
+		}
+		{
+			static constexpr Num12 x(1.5);
+			constexpr multi_view v(x);
+			static_assert(1 == v.size());
+			static_assert(1.5 == v.begin()->val.num);
+		}
+	}
+#endif // _DEBUG
+
+} // namespace xll
@@ -1,31 +1,246 @@
-// win_mem_view.cpp - memory mapped data
+// win_mem_view.h - growable memory mapped buffer
+/*
+	Win::mem_view<char> v;             // anonymous memory
+	Win::mem_view<double> f("x.bin");  // persisted to a file
+	f.append(x, n);
+
+	A large range of address space is reserved up front and pages are
+	committed as the buffer grows, so appending never copies and pointers
+	into the buffer stay valid. File backed buffers open with the data
+	already in the file and truncate it to size() when destroyed. A file
+	can be mapped by one mem_view at a time, in this or any other process.
+	On Windows a file backed view is remapped when it grows and data() may move.
+
+	Win::arena a;                                      // per call scratch
+	xll::OPER12 m(rows, columns, 0, &a);               // Multi block in the arena
+	m.set(i, x);                                       // cell strings in the arena too
+	std::vector<double, Win::allocator<double>> v(a);
+	...
+	a.reset();                                         // after m and v are gone
+
+	Assigning a cell through m[i] = x allocates from the default resource,
+	not the block's. Use m.set(i, x) to keep cell strings in the arena.
+*/
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#ifdef _WIN32
 #define NOMINMAX
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <memoryapi.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include "ensure.h"
 
 namespace Win {
 
+	inline size_t page_size()
+	{
+#ifdef _WIN32
+		static const size_t n = [] { SYSTEM_INFO si; GetSystemInfo(&si); return static_cast<size_t>(si.dwPageSize); }();
+#else
+		static const size_t n = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+		return n;
+	}
+
 	template<class T>
 	class mem_view {
-		HANDLE h;
-		DWORD max_len;
+		static_assert(std::is_trivially_copyable_v<T>);
+
+		T* buf = nullptr;
+		size_t len = 0;       // elements in use
+		size_t committed = 0; // bytes backed by memory or file
+		size_t reserved = 0;  // bytes of address space
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE map = NULL;
+#else
+		int fd = -1;
+#endif
+
+		static size_t round_up(size_t n)
+		{
+			size_t p = page_size();
+
+			return (n + p - 1) / p * p;
+		}
+		bool backed() const
+		{
+#ifdef _WIN32
+			return file != INVALID_HANDLE_VALUE;
+#else
+			return fd != -1;
+#endif
+		}
+
+		// Back [0, bytes) with memory or file pages.
+		void commit(size_t bytes)
+		{
+			ensure(bytes <= reserved);
+#ifdef _WIN32
+			if (backed()) {
+				if (buf) {
+					UnmapViewOfFile(buf);
+					CloseHandle(map);
+				}
+				ULARGE_INTEGER size{ .QuadPart = bytes };
+				map = CreateFileMapping(file, 0, PAGE_READWRITE, size.HighPart, size.LowPart, nullptr);
+				ensure(map != NULL);
+				buf = static_cast<T*>(MapViewOfFile(map, FILE_MAP_ALL_ACCESS, 0, 0, bytes));
+				ensure(buf);
+			}
+			else {
+				ensure(VirtualAlloc(reinterpret_cast<char*>(buf) + committed, bytes - committed, MEM_COMMIT, PAGE_READWRITE));
+			}
+#else
+			char* p = reinterpret_cast<char*>(buf) + committed;
+			if (backed()) {
+				ensure(0 == ftruncate(fd, static_cast<off_t>(bytes)));
+				ensure(MAP_FAILED != mmap(p, bytes - committed, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, static_cast<off_t>(committed)));
+			}
+			else {
+				ensure(0 == mprotect(p, bytes - committed, PROT_READ | PROT_WRITE));
+			}
+#endif
+			committed = bytes;
+		}
+		// Return pages in [bytes, committed) to reserved address space.
+		void decommit(size_t bytes)
+		{
+#ifdef _WIN32
+			if (backed()) {
+				UnmapViewOfFile(buf);
+				CloseHandle(map);
+				buf = nullptr;
+				map = NULL;
+				committed = 0;
+				LARGE_INTEGER size{ .QuadPart = static_cast<LONGLONG>(bytes) };
+				ensure(SetFilePointerEx(file, size, nullptr, FILE_BEGIN) && SetEndOfFile(file));
+				if (bytes) {
+					commit(bytes);
+				}
+			}
+			else {
+				if (bytes < committed) {
+					VirtualFree(reinterpret_cast<char*>(buf) + bytes, committed - bytes, MEM_DECOMMIT);
+				}
+				committed = bytes;
+			}
+#else
+			if (bytes < committed) {
+				ensure(MAP_FAILED != mmap(reinterpret_cast<char*>(buf) + bytes, committed - bytes, PROT_NONE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0));
+				if (backed()) {
+					ensure(0 == ftruncate(fd, static_cast<off_t>(bytes)));
+				}
+			}
+			committed = bytes;
+#endif
+		}
+		void reserve_address(size_t max_len)
+		{
+			reserved = round_up(max_len * sizeof(T));
+#ifdef _WIN32
+			if (!backed()) {
+				buf = static_cast<T*>(VirtualAlloc(nullptr, reserved, MEM_RESERVE, PAGE_NOACCESS));
+				ensure(buf);
+			}
+#else
+			void* p = mmap(nullptr, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			ensure(p != MAP_FAILED);
+			buf = static_cast<T*>(p);
+#endif
+		}
+		void release()
+		{
+#ifdef _WIN32
+			if (backed()) {
+				if (buf) {
+					UnmapViewOfFile(buf);
+				}
+				if (map) {
+					CloseHandle(map);
+				}
+				LARGE_INTEGER size{ .QuadPart = static_cast<LONGLONG>(len * sizeof(T)) };
+				SetFilePointerEx(file, size, nullptr, FILE_BEGIN);
+				SetEndOfFile(file);
+				CloseHandle(file);
+			}
+			else if (buf) {
+				VirtualFree(buf, 0, MEM_RELEASE);
+			}
+#else
+			if (buf) {
+				munmap(buf, reserved);
+			}
+			if (backed()) {
+				(void)ftruncate(fd, static_cast<off_t>(len * sizeof(T)));
+				close(fd);
+			}
+#endif
+		}
 	public:
-		T* buf;
-		DWORD len;
+		// Address space reserved by default: 64GB on 64-bit platforms.
+		static constexpr size_t default_max = (sizeof(void*) == 8 ? size_t(1) << 36 : size_t(1) << 28) / sizeof(T);
 
 		/// <summary>
-		/// Map file of temporary anonymous memory.
+		/// Map temporary anonymous memory.
+		/// </summary>
+		/// <param name="max_len">maximum number of elements</param>
+		explicit mem_view(size_t max_len = default_max)
+		{
+			reserve_address(max_len);
+		}
+		/// <summary>
+		/// Map a file, creating it if needed. Existing contents are the initial buffer.
 		/// </summary>
-		/// <param name="h">optional handle to file</param>
-		/// <param name="len">initial size of buffer</param>
-		mem_view(HANDLE h_ = INVALID_HANDLE_VALUE, DWORD max_len = 1 << 23)
-			: h(CreateFileMapping(h_, 0, PAGE_READWRITE, 0, max_len * sizeof(T), nullptr)), 
-			  max_len(max_len), buf(nullptr), len(0)
+		/// <param name="path">file to persist to</param>
+		/// <param name="max_len">maximum number of elements</param>
+		explicit mem_view(const char* path, size_t max_len = default_max)
 		{
-			if (h != NULL) {
-				buf = (T*)MapViewOfFile(h, FILE_MAP_ALL_ACCESS, 0, 0, len * sizeof(T));
+			size_t bytes;
+#ifdef _WIN32
+			file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+			ensure(file != INVALID_HANDLE_VALUE);
+			LARGE_INTEGER size;
+			ensure(GetFileSizeEx(file, &size));
+			bytes = static_cast<size_t>(size.QuadPart);
+#else
+			fd = open(path, O_RDWR | O_CREAT, 0644);
+			ensure(fd != -1);
+			if (0 != flock(fd, LOCK_EX | LOCK_NB)) {
+				close(fd);
+				fd = -1;
+				ensure(!"mem_view: file is mapped by another view");
+			}
+			struct stat st;
+			ensure(0 == fstat(fd, &st));
+			bytes = static_cast<size_t>(st.st_size);
+#endif
+			try {
+				reserve_address(std::max(max_len, bytes / sizeof(T)));
+				len = bytes / sizeof(T);
+				if (len) {
+					commit(round_up(bytes));
+				}
+			}
+			catch (...) {
+				len = 0;
+				release();
+				throw;
 			}
 		}
 		mem_view(const mem_view&) = delete;
@@ -37,26 +252,33 @@ namespace Win {
 		mem_view& operator=(mem_view&& mv) noexcept
 		{
 			if (this != &mv) {
-				h = std::exchange(mv.h, INVALID_HANDLE_VALUE);
-				buf = std::exchange(mv.buf, nullptr);
-				len = std::exchange(mv.len, 0);
+				std::swap(buf, mv.buf);
+				std::swap(len, mv.len);
+				std::swap(committed, mv.committed);
+				std::swap(reserved, mv.reserved);
+#ifdef _WIN32
+				std::swap(file, mv.file);
+				std::swap(map, mv.map);
+#else
+				std::swap(fd, mv.fd);
+#endif
 			}
 
 			return *this;
 		}
 		~mem_view()
 		{
-			if (buf) UnmapViewOfFile(buf);
-			if (h) CloseHandle(h);
+			release();
 		}
 
-		mem_view& reset(DWORD _len = 0)
+		T* data()
 		{
-			len = _len;
-
-			return *this;
+			return buf;
+		}
+		const T* data() const
+		{
+			return buf;
 		}
-
 		operator T* ()
 		{
 			return buf;
@@ -66,6 +288,28 @@ namespace Win {
 			return buf;
 		}
 
+		size_t size() const
+		{
+			return len;
+		}
+		// Elements available without committing more pages.
+		size_t capacity() const
+		{
+			return committed / sizeof(T);
+		}
+		size_t max_size() const
+		{
+			return reserved / sizeof(T);
+		}
+
+		T* begin()
+		{
+			return buf;
+		}
+		const T* begin() const
+		{
+			return buf;
+		}
 		T* end()
 		{
 			return buf + len;
@@ -75,11 +319,55 @@ namespace Win {
 			return buf + len;
 		}
 
+		// Commit pages for at least n elements. Grows geometrically.
+		mem_view& reserve(size_t n)
+		{
+			ensure(n <= max_size());
+			if (n > capacity()) {
+				size_t bytes = std::max(n * sizeof(T), std::max(2 * committed, size_t(1) << 16));
+				commit(std::min(round_up(bytes), reserved));
+			}
+
+			return *this;
+		}
+
+		// Set the number of elements in use.
+		mem_view& reset(size_t n = 0)
+		{
+			reserve(n);
+			len = n;
+
+			return *this;
+		}
+
+		// Release pages past the end. File backed buffers shrink to whole pages.
+		mem_view& shrink_to_fit()
+		{
+			decommit(round_up(len * sizeof(T)));
+
+			return *this;
+		}
+
+		// Write dirty pages of a file backed buffer to disk.
+		mem_view& flush()
+		{
+			if (backed() && committed) {
+#ifdef _WIN32
+				ensure(FlushViewOfFile(buf, 0));
+#else
+				ensure(0 == msync(buf, committed, MS_SYNC));
+#endif
+			}
+
+			return *this;
+		}
+
 		// Write to buffered memory.
-		mem_view& append(const T* s, DWORD n)
+		mem_view& append(const T* s, size_t n)
 		{
-			ensure(h && len + n < max_len);
+			ensure(len + n <= max_size());
 			if (n) {
+				reserve(len + n);
 				std::copy(s, s + n, buf + len);
 				len += n;
 			}
@@ -88,7 +376,7 @@ namespace Win {
 		}
 		mem_view& append(const T* b, const T* e)
 		{
-			return append(b, (DWORD)(e - b));
+			return append(b, static_cast<size_t>(e - b));
 		}
 		mem_view& append(T t)
 		{
@@ -96,6 +384,188 @@ namespace Win {
 		}
 	};
 
-	// class alocator...
+	// Bump allocator over anonymous mapped memory. Deallocation is a no-op and
+	// reset() releases everything at once. Objects using the arena must be
+	// destroyed before it is reset.
+	class arena : public std::pmr::memory_resource {
+		mem_view<std::byte> buf;
+
+		void* do_allocate(size_t bytes, size_t align) override
+		{
+			size_t p = (buf.size() + align - 1) & ~(align - 1);
+			if (p + bytes > buf.max_size()) {
+				throw std::bad_alloc{};
+			}
+			buf.reset(p + bytes);
+
+			return buf.data() + p;
+		}
+		void do_deallocate(void*, size_t, size_t) override
+		{ }
+		bool do_is_equal(const std::pmr::memory_resource& mr) const noexcept override
+		{
+			return this == &mr;
+		}
+	public:
+		explicit arena(size_t max_bytes = mem_view<std::byte>::default_max)
+			: buf(max_bytes)
+		{ }
+		arena(const arena&) = delete;
+		arena& operator=(const arena&) = delete;
+
+		// Bytes allocated since the last reset.
+		size_t size() const
+		{
+			return buf.size();
+		}
+		// Reuse committed pages for new allocations.
+		void reset()
+		{
+			buf.reset(0);
+		}
+		// Reset and return committed pages to the system.
+		void release()
+		{
+			buf.reset(0).shrink_to_fit();
+		}
+	};
+
+	// Standard allocator for containers using an arena.
+	template<class T>
+	class allocator {
+		arena* a;
+	public:
+		using value_type = T;
+
+		allocator(arena& a) noexcept
+			: a(&a)
+		{ }
+		template<class U>
+		allocator(const allocator<U>& u) noexcept
+			: a(u.resource())
+		{ }
+
+		arena* resource() const noexcept
+		{
+			return a;
+		}
+
+		T* allocate(size_t n)
+		{
+			if (n > std::numeric_limits<size_t>::max() / sizeof(T)) {
+				throw std::bad_array_new_length{};
+			}
+
+			return static_cast<T*>(a->allocate(n * sizeof(T), alignof(T)));
+		}
+		void deallocate(T*, size_t) noexcept
+		{ }
+
+		template<class U>
+		bool operator==(const allocator<U>& u) const noexcept
+		{
+			return a == u.resource();
+		}
+	};
+
+#ifdef _DEBUG
+	inline void test_mem_view()
+	{
+		{
+			mem_view<int> v(1 << 20);
+			ensure(v.size() == 0);
+			ensure(v.max_size() >= (1 << 20));
+			for (int i = 0; i < 100'000; ++i) {
+				v.append(i);
+			}
+			ensure(v.size() == 100'000);
+			ensure(v[99'999] == 99'999);
+			const int* p = v.data();
+			v.reserve(500'000);
+			ensure(p == v.data());
+			v.reset(10).shrink_to_fit();
+			ensure(v.size() == 10 && v[9] == 9);
+			ensure(v.capacity() * sizeof(int) == page_size());
+			v.append(v.begin(), v.end());
+			ensure(v.size() == 20 && v[19] == 9);
+
+			mem_view<int> w(std::move(v));
+			ensure(w.size() == 20 && v.data() == nullptr);
+
+			bool thrown = false;
+			try {
+				mem_view<char> s(10);
+				s.reset(page_size() + 1);
+			}
+			catch (const std::exception&) {
+				thrown = true;
+			}
+			ensure(thrown);
+		}
+		{
+			arena a(1 << 20);
+			void* p = a.allocate(3, 1);
+			void* q = a.allocate(8, 8);
+			ensure(reinterpret_cast<uintptr_t>(q) % 8 == 0);
+			ensure(static_cast<char*>(q) - static_cast<char*>(p) == 8);
+			ensure(a.size() == 16);
+			a.deallocate(q, 8, 8);
+			ensure(a.size() == 16);
+			a.reset();
+			ensure(a.size() == 0);
+			ensure(a.allocate(1, 1) == p);
+
+			std::vector<int, allocator<int>> v(a);
+			for (int i = 0; i < 10'000; ++i) {
+				v.push_back(i);
+			}
+			ensure(v[9'999] == 9'999);
+			std::pmr::vector<int> w(v.begin(), v.end(), &a);
+			ensure(w == std::pmr::vector<int>(v.begin(), v.end()));
+			ensure(allocator<double>(v.get_allocator()) == v.get_allocator());
+
+			bool thrown = false;
+			try {
+				void* r = a.allocate(1 << 20, 1);
+				a.deallocate(r, 1 << 20, 1);
+			}
+			catch (const std::bad_alloc&) {
+				thrown = true;
+			}
+			ensure(thrown);
+		}
+#ifndef _WIN32
+		{
+			char path[] = "/tmp/mem_viewXXXXXX";
+			int fd = mkstemp(path);
+			ensure(fd != -1);
+			close(fd);
+			{
+				mem_view<double> f(path);
+				ensure(f.size() == 0);
+				for (int i = 0; i < 10'000; ++i) {
+					f.append(i * 0.5);
+				}
+				f.flush();
+			}
+			struct stat st;
+			ensure(0 == stat(path, &st) && st.st_size == 10'000 * sizeof(double));
+			{
+				mem_view<double> f(path);
+				ensure(f.size() == 10'000);
+				ensure(f[9'999] == 9'999 * 0.5);
+				f.append(-1.).reset(5000).shrink_to_fit();
+				ensure(0 == stat(path, &st) && static_cast<size_t>(st.st_size) == f.capacity() * sizeof(double));
+				f.append(1.);
+			}
+			{
+				mem_view<double> f(path);
+				ensure(f.size() == 5001 && f[5000] == 1. && f[4999] == 4999 * 0.5);
+			}
+			unlink(path);
+		}
+#endif // _WIN32
+	}
+#endif // _DEBUG
 
-} // namespace Win
\ No newline at end of file
+} // namespace Win
@@ -1,16 +1,97 @@
 // xlauto.cpp - xlAuto* functions
 #include "xll.h"
+#include "xlregister.h"
+#include "async.h"
+#include "cluster.h"
 #include "win_mem_view.h"
+#ifdef XLL_BENCH
+#include "bench.h"
+#endif
 
 extern "C" int __declspec(dllexport) xlAutoOpen()
 {
 	try {
+		xll::Register(xll::Functions());
+		xll::async::register_cancel();
+		xll::lazy::register_command();
+#ifdef XLL_INSTRUMENT
+		xll::register_callback_stats();
+#endif
 	}
 	catch (const std::exception& ex) {
 		const char* s;
 		s = ex.what();
 	}
 
-	// use counted_array_view to register addins
 	return TRUE;
-}
\ No newline at end of file
+}
+
+extern "C" int __declspec(dllexport) xlAutoClose()
+{
+	xll::cluster::shutdown();
+	xll::async::shutdown();
+
+	return TRUE;
+}
+
+// Registered by async::register_cancel for xleventCalculationCanceled.
+extern "C" __declspec(dllexport) int WINAPI xll_async_cancel()
+{
+	xll::async::cancel();
+	xll::cluster::cancel();
+
+	return TRUE;
+}
+
+// Registered by lazy::register_command for xleventCalculationEnded.
+extern "C" __declspec(dllexport) int WINAPI xll_register_pending()
+{
+	try {
+		xll::lazy::register_pending();
+	}
+	catch (const std::exception&) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// Entry point of cluster worker processes started with rundll32.
+extern "C" __declspec(dllexport) void CALLBACK xll_cluster_worker(HWND, HINSTANCE, LPSTR, int)
+{
+	xll::cluster::serve();
+}
+
+#ifdef XLL_INSTRUMENT
+// Summary of callbacks into Excel. Registered by register_callback_stats.
+extern "C" __declspec(dllexport) LPXLOPER12 WINAPI xll_callback_stats()
+{
+	thread_local xll::OPER12 o;
+
+	try {
+		o = xll::callback_stats();
+	}
+	catch (const std::exception&) {
+		o = xll::OPER12(xll::XlErr::Value);
+	}
+
+	return &o;
+}
+#endif // XLL_INSTRUMENT
+
+#ifdef XLL_BENCH
+// Benchmark timings. Register with type text "Q$".
+extern "C" __declspec(dllexport) LPXLOPER12 WINAPI xll_bench()
+{
+	thread_local xll::OPER12 o;
+
+	try {
+		o = xll::bench::table();
+	}
+	catch (const std::exception&) {
+		o = xll::OPER12(xll::XlErr::Value);
+	}
+
+	return &o;
+}
+#endif // XLL_BENCH
@@ -0,0 +1,109 @@
+// xlfree.h - release Excel owned memory in batches
+// xlFree takes up to arg_max arguments so Excel owned OPERs destroyed inside
+// a free_scope are queued and released with one callback per batch.
+#pragma once
+#include "ensure.h"
+#include "xltraits.h"
+
+namespace xll {
+
+	template<is_xloper X>
+	class free_queue {
+		static inline thread_local free_queue* top = nullptr;
+		X pending[traits<X>::arg_max];
+		int n;
+		free_queue* prev;
+	public:
+		// Queue for this thread or nullptr if none is active.
+		static free_queue* current() noexcept
+		{
+			return top;
+		}
+
+		// Becomes the current queue until destroyed.
+		free_queue()
+			: n(0), prev(top)
+		{
+			top = this;
+		}
+		free_queue(const free_queue&) = delete;
+		free_queue& operator=(const free_queue&) = delete;
+		~free_queue()
+		{
+			flush();
+			top = prev;
+		}
+
+		int size() const noexcept
+		{
+			return n;
+		}
+
+		// Queue Excel owned x. Flush when a batch is full.
+		void push(const X& x)
+		{
+			if (n == traits<X>::arg_max) {
+				flush();
+			}
+			pending[n] = x;
+			pending[n].xltype &= ~xlbitXLFree;
+			++n;
+		}
+
+		// Release queued memory. Return number of callbacks made.
+		int flush()
+		{
+			if (n == 0) {
+				return 0;
+			}
+
+			X* px[traits<X>::arg_max];
+			for (int i = 0; i < n; ++i) {
+				px[i] = &pending[i];
+			}
+			traits<X>::Excelv(xlFree, 0, n, px);
+			n = 0;
+
+			return 1;
+		}
+	};
+
+	// Flush Excel owned memory at the end of a UDF or macro.
+	template<is_xloper X>
+	using free_scope = free_queue<X>;
+	using free_scope4 = free_scope<XLOPER>;
+	using free_scope12 = free_scope<XLOPER12>;
+
+#ifdef _DEBUG
+	inline void test_free_queue()
+	{
+		ensure(free_queue<XLOPER12>::current() == nullptr);
+		{
+			free_scope12 s;
+			ensure(free_queue<XLOPER12>::current() == &s);
+			ensure(free_queue<XLOPER>::current() == nullptr);
+			{
+				free_scope12 t;
+				ensure(free_queue<XLOPER12>::current() == &t);
+			}
+			ensure(free_queue<XLOPER12>::current() == &s);
+			ensure(s.flush() == 0);
+		}
+		ensure(free_queue<XLOPER12>::current() == nullptr);
+		{
+			// without Excel the xlFree callbacks fail and are ignored
+			free_queue<XLOPER12> q;
+			XLOPER12 x = { .val = {.num = 1}, .xltype = xltypeNum | xlbitXLFree };
+			for (int i = 0; i < traits<XLOPER12>::arg_max; ++i) {
+				q.push(x);
+			}
+			ensure(q.size() == traits<XLOPER12>::arg_max);
+			q.push(x); // full batch is released first
+			ensure(q.size() == 1);
+			ensure(q.flush() == 1);
+			ensure(q.size() == 0);
+		}
+	}
+#endif // _DEBUG
+
+} // namespace xll
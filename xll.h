@@ -7,5 +7,6 @@
 #include "XLCALL.H"
 #include "ensure.h"
 #include "excel.h"
+#include "fp.h"
 //#include "counted_array_view.h"
 
@@ -2,9 +2,10 @@
 // Use native C SDK XLOPER/12 structs
 #pragma once
 #include <algorithm>
+#include <limits>
 #include <map>
-#include "defines.h"
 #include "xlref.h"
+#include "defines.h"
 
 namespace xll {
 
@@ -14,6 +15,13 @@ namespace xll {
 		return x.xltype & ~(xlbitDLLFree | xlbitXLFree);
 	}
 
+	// Character count of a counted string. CHAR is signed so XLOPER counts over 127 are negative.
+	template<XlOper X>
+	inline constexpr size_t str_count(const X& x)
+	{
+		return static_cast<std::make_unsigned_t<typename traits<xloper_t<X>>::xchar>>(x.val.str[0]);
+	}
+
 	template<XlOper X>
 	constexpr bool as_bool(const X& x)
 	{
@@ -43,7 +51,7 @@ namespace xll {
 	}
 
 	template<XlOper X>
-	inline traits<typename X::type>::xrw rows(const X& x)
+	inline traits<xloper_t<X>>::xrw rows(const X& x)
 	{
 		switch (type(x)) {
 			case xltypeMulti:
@@ -59,7 +67,7 @@ namespace xll {
 	}
 
 	template<XlOper X>
-	inline traits<typename X::type>::xcol columns(const X& x)
+	inline traits<xloper_t<X>>::xcol columns(const X& x)
 	{
 		switch (type(x)) {
 			case xltypeMulti:
@@ -75,9 +83,9 @@ namespace xll {
 	}
 
 	template<XlOper X>
-	inline traits<typename X::type>::xrw size(const X& x)
+	inline size_t size(const X& x)
 	{
-		return rows(x) * columns(x);
+		return (size_t)rows(x) * columns(x);
 	}
 
 	template<XlOper X>
@@ -98,7 +106,7 @@ namespace xll {
 	template<XlOper X>
 	inline const X* end(const X& x)
 	{
-		return xltypeMulti == type(x) ? (X*)x.val.array.lparray /*+ size(x)*/ : &x + 1;
+		return xltypeMulti == type(x) ? (X*)x.val.array.lparray + size(x) : &x + 1;
 	}
 
 	template<XlOper X, XlOper Y>
@@ -112,10 +120,10 @@ namespace xll {
 		case xltypeNum:
 			return x.val.num == y.val.num;
 		case xltypeStr:
-			if (x.val.str[0] != y.val.str[0]) {
+			if (str_count(x) != str_count(y)) {
 				return false;
 			}
-			for (int i = 1; i <= x.val.str[0]; ++i) {
+			for (size_t i = 1; i <= str_count(x); ++i) {
 				if (x.val.str[i] != y.val.str[i]) {
 					return false;
 				}
@@ -129,7 +137,12 @@ namespace xll {
 			if (x.val.array.rows != y.val.array.rows || x.val.array.columns != y.val.array.columns) {
 				return false;
 			}
-			return std::equal(begin(x), end(x), begin(y), end(y));
+			for (size_t i = 0; i < size_t(x.val.array.rows) * x.val.array.columns; ++i) {
+				if (!xll::operator==(x.val.array.lparray[i], y.val.array.lparray[i])) {
+					return false;
+				}
+			}
+			return true;
 		case xltypeSRef:
 			return x.val.sref.ref == y.val.sref.ref;
 		case xltypeInt:
@@ -143,24 +156,24 @@ namespace xll {
 	template<XlOper X>
 	constexpr X& index(X& x, int i)
 	{
-		return x.val.array[i];
+		return ((X*)x.val.array.lparray)[i];
 	}
 	template<XlOper X>
-	constexpr const X& index(X& x, int i)
+	constexpr const X& index(const X& x, int i)
 	{
-		return x.val.array[i];
+		return ((const X*)x.val.array.lparray)[i];
 	}
 
 	// 2-d index
 	template<XlOper X>
 	constexpr X& index(X& x, int i, int j)
 	{
-		return x.val.array[i * columns(x) + j];
+		return ((X*)x.val.array.lparray)[i * x.val.array.columns + j];
 	}
 	template<XlOper X>
-	constexpr const X& index(X& x, int i, int j)
+	constexpr const X& index(const X& x, int i, int j)
 	{
-		return x.val.array[i*columns(x) + j];
+		return ((const X*)x.val.array.lparray)[i * x.val.array.columns + j];
 	}
 
 	// xltypeNum = 1
@@ -304,78 +317,102 @@ namespace xll {
 	}
 #endif // _DEBUG
 
+	// Constant XLOPER or XLOPER12 string in read-only data.
+	template<counted_literal S>
+	inline constexpr typename decltype(S)::xloper counted_xloper
+		= { .val = {.str = const_cast<typename decltype(S)::xchar*>(S.str)}, .xltype = xltypeStr };
+
+	inline namespace literals {
+
+		// "abc"_xl is an XLOPER and L"abc"_xl is an XLOPER12.
+		template<counted_literal S>
+		constexpr const auto& operator""_xl()
+		{
+			return counted_xloper<S>;
+		}
+
+	} // namespace literals
+
+#ifdef _DEBUG
+	inline void test_xloper_literal()
+	{
+		{
+			constexpr const XLOPER12& s = L"abc"_xl;
+			static_assert(xltypeStr == s.xltype);
+			static_assert(3 == s.val.str[0]);
+			static_assert(L'c' == s.val.str[3]);
+		}
+		{
+			constexpr const XLOPER& s = "ab"_xl;
+			static_assert(xltypeStr == s.xltype);
+			static_assert(2 == s.val.str[0]);
+		}
+	}
+#endif // _DEBUG
+
 	// xltypeMulti = 0x40
-	template<is_index R, is_index C, class X = typename traits<R>::xloper>
+	// Fixed size table that can be constexpr and live in read-only data.
+	// The array points into the object so it cannot be copied.
+	template<size_t R, size_t C, is_xloper X = XLOPERX>
 	struct Multi : X {
 		using type = X;
+		static_assert(R <= traits<X>::rw_max);
+		static_assert(C <= traits<X>::col_max);
 
 		X arr[R * C];
-		constexpr Multi()
-			: X{ .val = {.array = {.rows = R, .columns = C}, .xltpe = xltypeMulti } }
-		{ 
-			static_assert(R <= traits<X>::rw_max);
-			static_assert(C <= traits<X>::col_max);
 
-			type::val.array.lparray = arr;
-			for (auto& a : arr) {
-				a.xltype = xltypeNil;
-			}
-		}
-	};
-	//template<WORD R, WORD C>
-	//using Multi4 = Multi<R, C, XLOPER>;
-/*
-template<int R = 1, int C = 1>
-	struct Multi12 : XLOPER12 {
-		using type = XLOPER12;
-
-		XLOPER12 arr[R * C];
-		constexpr Multi12()
-			: type{ .val = {.array = {.rows = R, .columns = C}}, .xltype = xltypeMulti}
+		// All elements Nil.
+		constexpr Multi()
+			: X{ .val = {.array = {.lparray = arr, .rows = R, .columns = C}}, .xltype = xltypeMulti }, arr{}
 		{
-			static_assert(R <= traits<XLOPER12>::rw_max);
-			static_assert(C <= traits<XLOPER12>::col_max);
-
-			type::val.array.lparray = arr;
 			for (auto& a : arr) {
 				a.xltype = xltypeNil;
 			}
 		}
-	};
-	template<unsigned int R = 1, unsigned int C = 1>
-	struct Multi4 : XLOPER {
-		using type = XLOPER;
-
-		XLOPER arr[R * C] = { 0 };
-		constexpr Multi4()
-			: type{ .val = {.array = {.lparray = arr, .rows = R, .columns = C }}, .xltype = xltypeMulti }
+		// Elements in row-major order.
+		constexpr Multi(const X(&a)[R * C])
+			: X{ .val = {.array = {.lparray = arr, .rows = R, .columns = C}}, .xltype = xltypeMulti }, arr{}
 		{
-			static_assert(R <= traits<XLOPER>::rw_max);
-			static_assert(C <= traits<XLOPER>::col_max);
-
-			for (auto& a : arr) {
-				a.xltype = xltypeNil;
+			for (size_t i = 0; i < R * C; ++i) {
+				arr[i] = a[i];
 			}
 		}
+		Multi(const Multi&) = delete;
+		Multi& operator=(const Multi&) = delete;
 	};
-	*/
+	template<size_t R, size_t C>
+	using Multi4 = Multi<R, C, XLOPER>;
+	template<size_t R, size_t C>
+	using Multi12 = Multi<R, C, XLOPER12>;
+
 #ifdef _DEBUG
 	inline void test_xloper_multi()
 	{
 		{
-//			constexpr Multi<1, 2> m;
-//			static_assert(1 == rows(m));
+			static constexpr Multi<1, 2> m;
+			static_assert(xltypeMulti == m.xltype);
+			static_assert(1 == m.val.array.rows);
+			static_assert(2 == m.val.array.columns);
+			static_assert(xltypeNil == m.val.array.lparray[1].xltype);
 		}
-		/*
 		{
-			constexpr Multi<1u, 2u> m;
-			static_assert(2 == columns(m));
+			static constexpr Multi12<2, 2> m({ Num12(1.5), L"abc"_xl, Bool12(true), Err12(XlErr::NA) });
+			static_assert(m.val.array.lparray == m.arr);
+			static_assert(1.5 == m.arr[0].val.num);
+			static_assert(3 == m.arr[1].val.str[0]);
+			static_assert(xltypeBool == m.arr[2].xltype);
+			static_assert(xlerrNA == m.arr[3].val.err);
 		}
 		{
-			constexpr Multi<2u, 3u> m;
-			static_assert(6 == size(m));
+			static constexpr Multi4<2, 3> m;
+			static_assert(6 == m.val.array.rows * m.val.array.columns);
+		}
+		{
+			XLOPER x{ .xltype = xltypeMulti };
+			x.val.array.rows = 300;
+			x.val.array.columns = 300;
+			ensure(size(x) == 90000); // wider than WORD
 		}
-		*/
 	}
 #endif // _DEBUG
 
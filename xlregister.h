@@ -1,81 +1,391 @@
-// xll_register.h - register an add-in
+// xlregister.h - register add-in functions
 /*
-    class AddIn xai_foo(Function(XLL_DOUBLE, "xll_foo", "XLL.FOO"));
+	static constexpr XLOPERX foo_help[] = { L"is the first argument"_xl };
+	constexpr Function functions[] = {
+		{
+			.procedure = L"xll_foo"_xl,
+			.typeText = TypeText<xll_foo, Flag::Reentrant>,
+			.functionText = L"XLL.FOO"_xl,
+			.argumentText = L"x"_xl,
+			.category = L"XLL"_xl,
+			.functionHelp = L"call foo"_xl,
+			.argumentHelp = foo_help,
+		},
+	};
+	XLL_FUNCTIONS(functions)
 
-	OPER args;
-	args = Function(args, XLL_DOUBLE, "xll_foo", "XLL.FOO");
+	xlAutoOpen registers every entry in one pass.
 
-	Register(LPXLOPER12 pxProcedure,
-    LPXLOPER12 pxTypeText,     LPXLOPER12 pxFunctionText,
-    LPXLOPER12 pxArgumentText, LPXLOPER12 pxMacroType,
-    LPXLOPER12 pxCategory,     LPXLOPER12 pxShortcutText,
-    LPXLOPER12 pxHelpTopic,    LPXLOPER12 pxFunctionHelp,
-    LPXLOPER12 pxArgumentHelp1, LPXLOPER12 pxArgumentHelp2,...)
+	Rarely used functions can defer work until they are first called.
 
-	Register("xll_foo", XLL_DOUBLE XLL_CSTRING, "XLL.FOO", "arg,...",
-		MACRO, "Cat", void, "https://foo.org", "call foo", "first arg");
+	constexpr Function bar = { ..., .init = load_tables, .lazy = true };
+	static Lazy bar_lazy(bar);
+	double WINAPI xll_bar(double x)
+	{
+		bar_lazy();
+		...
+	}
 
+	Excel refuses xlfRegister from a function, so the first call only queues the
+	full registration. lazy::register_command has Excel run lazy::register_pending
+	when the calculation ends.
 */
 #pragma once
+#include <array>
+#include <bit>
+#include <mutex>
+#include <string>
+#include <span>
 #include <vector>
 #include "excel.h"
+#ifdef _DEBUG
+#include "host.h"
+#endif
 
 namespace xll {
 
-	template<
-		class Procedure,
-		class TypeText,
-		class FunctionText,
-		class ArgumentText,
-		class MacroType,
-		class Category,
-		class ShortcutText,
-		class HelpTopic,
-		class FunctionHelp,
-		class... ArgumentHelp>
-	inline XLOPERX Register(
-		const Procedure& procedure,
-		const TypeText& typeText,
-		const FunctionText& functionText,
-		const ArgumentText& argumentText,
-		const MacroType& macroType,
-		const Category& category,
-		const ShortcutText& shortcutText,
-		const HelpTopic& helpTopic,
-		const FunctionHelp* functionHelp
-		//const ArgumentHelp...& argumentHelp
-		)
+	// Register flags appended to the type text.
+	enum class Flag : unsigned {
+		None = 0,
+		Reentrant = 1,   // $ thread-safe
+		ClusterSafe = 2, // & cluster-safe
+		Volatile = 4,    // ! recalculate every time
+		Macro = 8,       // # macro sheet equivalent
+	};
+	constexpr Flag operator|(Flag a, Flag b)
+	{
+		return static_cast<Flag>(static_cast<unsigned>(a) | static_cast<unsigned>(b));
+	}
+	constexpr bool operator&(Flag a, Flag b)
 	{
-		OPER arg(11 + sizeof...(ArgumentHelp), 1);
-		int i = 0;
-		arg[0] = Excel(xlGetName);
-		arg[1] = procedure;
-		arg[2] = typeText;
-		arg[3] = typeText;
-		arg[4] = functionText;
-		arg[5] = argumentText;
-		arg[6] = macroType;
-		arg[7] = category;
-		arg[8] = shortcutText;
-		arg[9] = helpTopic;
-		arg[10] = functionHelp;
-//				class... ArgumentHelp
-				// array of pointers
-		int count = 10;
-		std::vector<XLOPERX*> args(args.size());
-		for (const auto& a : args) {
-			args[i] = &arg[i];
+		return (static_cast<unsigned>(a) & static_cast<unsigned>(b)) != 0;
+	}
+
+	namespace detail {
+
+		// Cheapest register type code for C++ type T.
+		template<class T>
+		struct type_code {
+			static_assert(sizeof(T) == 0, "no register type code for this type");
+		};
+		template<> struct type_code<double> { static constexpr char code[] = "B"; };
+		template<> struct type_code<double*> { static constexpr char code[] = "E"; };
+		template<> struct type_code<short> { static constexpr char code[] = "I"; };
+		template<> struct type_code<unsigned short> { static constexpr char code[] = "H"; };
+		template<> struct type_code<int> { static constexpr char code[] = "J"; };
+		// counted strings
+		template<> struct type_code<const XCHAR*> { static constexpr char code[] = "D%"; };
+		template<> struct type_code<const CHAR*> { static constexpr char code[] = "D"; };
+		// arrays of doubles
+		template<> struct type_code<FP12*> { static constexpr char code[] = "K%"; };
+		template<> struct type_code<const FP12*> { static constexpr char code[] = "K%"; };
+		template<> struct type_code<FP*> { static constexpr char code[] = "K"; };
+		template<> struct type_code<const FP*> { static constexpr char code[] = "K"; };
+		// references are converted to values
+		template<> struct type_code<LPXLOPER12> { static constexpr char code[] = "Q"; };
+		template<> struct type_code<const XLOPER12*> { static constexpr char code[] = "Q"; };
+		template<> struct type_code<LPXLOPER> { static constexpr char code[] = "P"; };
+		template<> struct type_code<const XLOPER*> { static constexpr char code[] = "P"; };
+
+		// Codes of the result followed by the arguments.
+		template<class F>
+		struct signature;
+		template<class R, class... A>
+		struct signature<R(*)(A...)> {
+			static constexpr const char* codes[] = { type_code<R>::code, type_code<A>::code... };
+		};
+		template<class R, class... A>
+		struct signature<R(*)(A...) noexcept> : signature<R(*)(A...)> { };
+
+		template<auto F, Flag flags>
+		constexpr auto type_text()
+		{
+			static_assert(!(flags & Flag::Macro) || !(flags & (Flag::Reentrant | Flag::ClusterSafe)),
+				"macro sheet equivalent functions cannot be thread-safe or cluster-safe");
+			using xchar = traits<XLOPERX>::xchar;
+			constexpr auto& codes = signature<decltype(F)>::codes;
+			constexpr size_t len = [&codes] {
+				size_t n = std::popcount(static_cast<unsigned>(flags));
+				for (const char* c : codes) {
+					n += std::char_traits<char>::length(c);
+				}
+				return n;
+			}();
+			static_assert(len < traits<XLOPERX>::str_max);
+
+			std::array<xchar, len + 1> s{};
+			size_t i = 0;
+			s[i++] = static_cast<xchar>(len);
+			for (const char* c : codes) {
+				while (*c) {
+					s[i++] = static_cast<xchar>(*c++);
+				}
+			}
+			if (flags & Flag::Volatile) {
+				s[i++] = '!';
+			}
+			if (flags & Flag::Macro) {
+				s[i++] = '#';
+			}
+			if (flags & Flag::Reentrant) {
+				s[i++] = '$';
+			}
+			if (flags & Flag::ClusterSafe) {
+				s[i++] = '&';
+			}
+
+			return s;
+		}
+
+		template<auto F, Flag flags>
+		inline constexpr auto type_text_str = type_text<F, flags>();
+
+	} // namespace detail
+
+	// Type text for function pointer F, e.g. .typeText = TypeText<xll_foo, Flag::Reentrant>.
+	template<auto F, Flag flags = Flag::None>
+	inline constexpr XLOPERX TypeText
+		= { .val = {.str = const_cast<traits<XLOPERX>::xchar*>(detail::type_text_str<F, flags>.data())}, .xltype = xltypeStr };
+
+	// Arguments to xlfRegister after the module name. Text is counted and lives in
+	// read-only data so a table of these is built at compile time.
+	struct Function {
+		XLOPERX procedure = { .xltype = xltypeMissing };
+		XLOPERX typeText = { .xltype = xltypeMissing };
+		XLOPERX functionText = { .xltype = xltypeMissing };
+		XLOPERX argumentText = { .xltype = xltypeMissing };
+		XLOPERX macroType = { .val = {.num = 1}, .xltype = xltypeNum }; // 1 function, 2 macro
+		XLOPERX category = { .xltype = xltypeMissing };
+		XLOPERX shortcutText = { .xltype = xltypeMissing };
+		XLOPERX helpTopic = { .xltype = xltypeMissing };
+		XLOPERX functionHelp = { .xltype = xltypeMissing };
+		std::span<const XLOPERX> argumentHelp;
+		void (*init)() = nullptr; // expensive setup run before the first call
+		bool lazy = false;        // register a stub at open and the rest on first call
+
+		// Number of xlfRegister arguments.
+		constexpr size_t count() const
+		{
+			return 10 + argumentHelp.size();
+		}
+		// Module, procedure, type text, and function text make the function callable.
+		static constexpr size_t stub_count = 4;
+	};
+
+	// Functions registered by xlAutoOpen. Defined by the add-in using XLL_FUNCTIONS.
+	std::span<const Function> Functions();
+#define XLL_FUNCTIONS(table) std::span<const xll::Function> xll::Functions() { return table; }
+
+	// Register the first count arguments of f, or all if 0, using the name of this module.
+	// Return the register id or #VALUE!.
+	inline XLOPERX Register(const Function& f, const XLOPERX& module, size_t count = 0)
+	{
+		ensure(f.count() <= traits<XLOPERX>::arg_max);
+		ensure(count <= f.count());
+
+		const XLOPERX* fixed[] = { &module, &f.procedure, &f.typeText, &f.functionText, &f.argumentText,
+			&f.macroType, &f.category, &f.shortcutText, &f.helpTopic, &f.functionHelp };
+		XLOPERX* args[traits<XLOPERX>::arg_max];
+		size_t n = 0;
+		for (const XLOPERX* a : fixed) {
+			args[n++] = const_cast<XLOPERX*>(a);
+		}
+		for (const XLOPERX& a : f.argumentHelp) {
+			args[n++] = const_cast<XLOPERX*>(&a);
 		}
 
 		XLOPERX registerId = { .xltype = xltypeNil };
-		int ret = traits<XLOPERX>::Excelv(xlfRegister, &registerId, count, (XLOPERX**)&args[0]);
+		int ret = traits<XLOPERX>::Excelv(xlfRegister, &registerId, static_cast<int>(count ? count : n), args);
 		if (ret != xlretSuccess || registerId.xltype != xltypeNum) {
-			OPER xMsg("Failed to register: ");
-			//Excel(xlcAlert, xMsg /* & args.FunctionText()*/, OPER(2));
+			registerId = XErr<XLOPERX>(XlErr::Value);
 		}
 
 		return registerId;
-		return 0;
 	}
 
+	// Register every function in one pass. Lazy functions get a stub.
+	// Return the number registered.
+	inline size_t Register(std::span<const Function> fs)
+	{
+		size_t n = 0;
+		OPER module = Excel(xlGetName);
+
+		for (const Function& f : fs) {
+			if (Register(f, module, f.lazy ? Function::stub_count : 0).xltype == xltypeNum) {
+				++n;
+			}
+		}
+
+		return n;
+	}
+
+	namespace lazy {
+
+		inline std::mutex mutex;
+		inline std::vector<const Function*> pending; // called and not fully registered
+
+		// Queue the full registration of f for the next command.
+		inline void defer(const Function& f)
+		{
+			std::lock_guard lock(mutex);
+			pending.push_back(&f);
+		}
+
+		// Fully register every queued function. Call only from a command.
+		// Return the number registered. Functions Excel refuses keep their stub.
+		inline size_t register_pending()
+		{
+			std::vector<const Function*> fs;
+			{
+				std::lock_guard lock(mutex);
+				fs.swap(pending);
+			}
+			if (fs.empty()) {
+				return 0;
+			}
+
+			size_t n = 0;
+			OPER module = Excel(xlGetName);
+			for (const Function* f : fs) {
+				if (Register(*f, module).xltype == xltypeNum) {
+					++n;
+				}
+			}
+
+			return n;
+		}
+
+		// Command called by Excel when a calculation ends.
+		inline constexpr Function pending_command = {
+			.procedure = L"xll_register_pending"_xl,
+			.typeText = L"J"_xl,
+			.functionText = L"XLL.REGISTER.PENDING"_xl,
+			.macroType = Num(2),
+		};
+
+		// Register pending_command for xleventCalculationEnded.
+		inline bool register_command()
+		{
+			OPER module = Excel(xlGetName);
+			if (Register(pending_command, module).xltype != xltypeNum) {
+				return false;
+			}
+			OPER12 event(xleventCalculationEnded);
+			XLOPER12* args[2] = { const_cast<XLOPER12*>(&pending_command.functionText), &event };
+			XLOPER12 ret = { .xltype = xltypeNil };
+
+			return xlretSuccess == traits<XLOPER12>::Excelv(xlEventRegister, &ret, 2, args);
+		}
+
+	} // namespace lazy
+
+	// First call of a lazy function runs init exactly once and queues the full
+	// registration for lazy::register_pending. No callbacks are made.
+	class Lazy {
+		const Function& f;
+		std::once_flag once;
+	public:
+		constexpr Lazy(const Function& f)
+			: f(f)
+		{ }
+		Lazy(const Lazy&) = delete;
+		Lazy& operator=(const Lazy&) = delete;
+
+		const Function& function() const
+		{
+			return f;
+		}
+
+		void operator()()
+		{
+			std::call_once(once, [this] {
+				if (f.init) {
+					f.init();
+				}
+				if (f.lazy) {
+					lazy::defer(f);
+				}
+			});
+		}
+	};
+
+#ifdef XLL_INSTRUMENT
+	// XLL.CALLBACK.STATS() returns callback_stats(). Exported by xlauto.cpp.
+	inline constexpr Function callback_stats_function = {
+		.procedure = L"xll_callback_stats"_xl,
+		.typeText = L"Q$"_xl,
+		.functionText = L"XLL.CALLBACK.STATS"_xl,
+		.category = L"XLL"_xl,
+		.functionHelp = L"Count, latency, and failures of callbacks into Excel."_xl,
+	};
+
+	// Register callback_stats_function.
+	inline bool register_callback_stats()
+	{
+		OPER module = Excel(xlGetName);
+
+		return Register(callback_stats_function, module).xltype == xltypeNum;
+	}
+#endif // XLL_INSTRUMENT
+
+#ifdef _DEBUG
+	inline void test_register()
+	{
+		static constexpr XLOPERX help[] = { Num(1), Num(2) };
+		constexpr Function f = {
+			.procedure = L"xll_foo"_xl,
+			.typeText = L"BB$"_xl,
+			.argumentHelp = help,
+		};
+		static_assert(12 == f.count());
+		static_assert(xltypeStr == f.procedure.xltype);
+		static_assert(xltypeMissing == f.functionText.xltype);
+		static_assert(1 == f.macroType.val.num);
+		static_assert(!f.lazy);
+
+		static int inits = 0;
+		static constexpr Function g = { .procedure = L"xll_bar"_xl, .init = [] { ++inits; }, .lazy = true };
+		static constexpr Function functions[] = { f, g };
+		{
+			host h;
+			h.install();
+			ensure(2 == Register(functions));
+			ensure(h.registered.size() == 2);
+
+			// first call runs init and makes no callbacks
+			Lazy lazy(g);
+			ensure(&lazy.function() == &g);
+			size_t calls = h.callbacks;
+			lazy();
+			lazy();
+			ensure(inits == 1);
+			ensure(h.callbacks == calls);
+			ensure(h.registered.size() == 2);
+
+			// the command registers it once
+			ensure(1 == lazy::register_pending());
+			ensure(h.registered.size() == 3);
+			ensure(h.registered.back() == OPER12(L"xll_bar"));
+			ensure(0 == lazy::register_pending());
+			ensure(h.registered.size() == 3);
+
+			ensure(lazy::register_command());
+			ensure(h.registered.back() == OPER12(L"xll_register_pending"));
+#ifdef XLL_INSTRUMENT
+			ensure(register_callback_stats());
+			ensure(h.registered.back() == OPER12(L"xll_callback_stats"));
+#endif
+		}
+
+		using ndouble = double(*)(double, FP12*, const XCHAR*) noexcept;
+		constexpr const XLOPERX& t = TypeText<ndouble(nullptr), Flag::Reentrant | Flag::Volatile>;
+		static_assert(xltypeStr == t.xltype);
+		static_assert(8 == t.val.str[0]);
+		static_assert('B' == t.val.str[1] && 'K' == t.val.str[3] && '%' == t.val.str[4]);
+		static_assert('D' == t.val.str[5] && '%' == t.val.str[6]);
+		static_assert('!' == t.val.str[7] && '$' == t.val.str[8]);
+		static_assert(xltypeStr == TypeText<static_cast<LPXLOPER12(*)(LPXLOPER12)>(nullptr)>.xltype);
+	}
+#endif // _DEBUG
+
 } // namespace xll
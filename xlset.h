@@ -0,0 +1,245 @@
+// xlset.h - buffered writes to cells using xlSet
+// Each xlSet is a callback into Excel so pending writes are merged into
+// rectangles and each rectangle is set with one Multi.
+#pragma once
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <vector>
+#include "oper.h"
+#ifdef _DEBUG
+#include "host.h"
+#endif
+
+namespace xll {
+
+	class range_writer {
+		struct cell {
+			RW r;
+			COL c;
+			OPER12 v;
+		};
+		std::vector<cell> pending;
+		IDSHEET sheet;
+
+		static bool less(const cell& a, const cell& b)
+		{
+			return std::tie(a.r, a.c) < std::tie(b.r, b.c);
+		}
+		// Sort row-major and keep the last write to each cell.
+		void normalize()
+		{
+			std::stable_sort(pending.begin(), pending.end(), less);
+			auto e = pending.begin();
+			for (auto i = pending.begin(); i != pending.end(); ++i) {
+				if (e != pending.begin() && (e - 1)->r == i->r && (e - 1)->c == i->c) {
+					*(e - 1) = std::move(*i);
+				}
+				else {
+					if (e != i) {
+						*e = std::move(*i);
+					}
+					++e;
+				}
+			}
+			pending.erase(e, pending.end());
+		}
+	public:
+		// Writes to sheet or the active sheet if 0.
+		explicit range_writer(IDSHEET sheet = 0)
+			: sheet(sheet)
+		{ }
+		range_writer(const range_writer&) = delete;
+		range_writer& operator=(const range_writer&) = delete;
+		~range_writer()
+		{
+			try {
+				flush();
+			}
+			catch (...) {
+				; // nothing to report to from a destructor
+			}
+		}
+
+		size_t size() const
+		{
+			return pending.size();
+		}
+
+		// Queue a write. A Multi must have the shape of ref. Scalars fill every cell of ref.
+		range_writer& set(const REF& ref, const XLOPER12& v)
+		{
+			bool multi = type(v) == xltypeMulti;
+			ensure(!multi || (v.val.array.rows == height(ref) && v.val.array.columns == width(ref)));
+
+			for (RW i = 0; i < height(ref); ++i) {
+				for (COL j = 0; j < width(ref); ++j) {
+					pending.emplace_back(cell{ ref.rwFirst + i, ref.colFirst + j,
+						OPER12(multi ? v.val.array.lparray[i * width(ref) + j] : v) });
+				}
+			}
+
+			return *this;
+		}
+
+		// Rectangles exactly covering pending writes. Runs of adjacent cells in a row
+		// are merged with runs having the same columns in the previous row.
+		std::vector<REF> blocks()
+		{
+			normalize();
+
+			std::vector<REF> b;
+			std::map<std::pair<COL, COL>, size_t> open, next; // runs ending on previous row
+			for (size_t i = 0; i < pending.size(); ) {
+				RW r = pending[i].r;
+				COL c0 = pending[i].c;
+				size_t j = i + 1;
+				while (j < pending.size() && pending[j].r == r && pending[j].c == pending[j - 1].c + 1) {
+					++j;
+				}
+				COL c1 = pending[j - 1].c;
+
+				if (i > 0 && pending[i - 1].r != r) {
+					open.swap(next);
+					next.clear();
+				}
+				auto k = open.find({ c0, c1 });
+				if (k != open.end() && b[k->second].rwLast == r - 1) {
+					b[k->second].rwLast = r;
+					next[{ c0, c1 }] = k->second;
+				}
+				else {
+					next[{ c0, c1 }] = b.size();
+					b.push_back(REF(r, c0, 1, c1 - c0 + 1));
+				}
+				i = j;
+			}
+
+			return b;
+		}
+
+		// One xlSet per block. Return the number of callbacks made.
+		// Pending writes are dropped before the first callback so a failed
+		// xlSet is not retried by the destructor.
+		int flush()
+		{
+			int n = 0;
+			std::vector<REF> refs = blocks();
+			std::vector<cell> cells;
+			cells.swap(pending);
+
+			for (const REF& ref : refs) {
+				// cells of row i of the block are contiguous
+				auto row = [&cells, &ref](RW i) {
+					return std::lower_bound(cells.begin(), cells.end(), cell{ ref.rwFirst + i, ref.colFirst }, less);
+				};
+
+				OPER12 v;
+				if (area(ref) == 1) {
+					v = row(0)->v;
+				}
+				else {
+					size_t extra = 0;
+					for (RW i = 0; i < height(ref); ++i) {
+						auto p = row(i);
+						for (COL j = 0; j < width(ref); ++j, ++p) {
+							if (type(p->v) == xltypeStr) {
+								extra += OPER12::str_bytes(p->v.val.str[0]);
+							}
+						}
+					}
+					v = OPER12(height(ref), width(ref), extra);
+					for (RW i = 0; i < height(ref); ++i) {
+						auto p = row(i);
+						for (COL j = 0; j < width(ref); ++j, ++p) {
+							v.set(static_cast<size_t>(i) * width(ref) + j, p->v);
+						}
+					}
+				}
+
+				XLMREF12 mref = { .count = 1, .reftbl = { ref } };
+				XLOPER12 x = sheet
+					? XLOPER12{ .val = {.mref = {.lpmref = &mref, .idSheet = sheet}}, .xltype = xltypeRef }
+					: XLOPER12{ .val = {.sref = {.count = 1, .ref = ref}}, .xltype = xltypeSRef };
+				XLOPER12* args[2] = { &x, &v };
+				XLOPER12 res = { .xltype = xltypeNil };
+				int ret = traits<XLOPER12>::Excelv(xlSet, &res, 2, args);
+				++n;
+				ensure(ret == xlretSuccess);
+			}
+
+			return n;
+		}
+	};
+
+#ifdef _DEBUG
+	inline void test_range_writer()
+	{
+		{
+			range_writer w;
+			w.set(REF(0, 0), OPER12(1.));
+			w.set(REF(0, 1), OPER12(2.));
+			w.set(REF(1, 0, 1, 2), OPER12(L"x"));
+			w.set(REF(1, 3), OPER12(4.));
+			w.set(REF(5, 5), OPER12(5.));
+			w.set(REF(0, 0), OPER12(0.)); // last write wins
+			auto b = w.blocks();
+			ensure(b.size() == 3);
+			ensure(b[0] == REF(0, 0, 2, 2));
+			ensure(b[1] == REF(1, 3));
+			ensure(b[2] == REF(5, 5));
+			ensure(w.size() == 6);
+		}
+		{
+			range_writer w;
+			OPER12 m(2, 2);
+			w.set(REF(0, 0, 2, 2), m);
+			w.set(REF(2, 0, 1, 3), OPER12(1.));
+			auto b = w.blocks();
+			ensure(b.size() == 2);
+			ensure(b[0] == REF(0, 0, 2, 2));
+			ensure(b[1] == REF(2, 0, 1, 3));
+		}
+		{
+			host h;
+			h.install();
+			{
+				range_writer w;
+				for (RW i = 0; i < 3; ++i) {
+					for (COL j = 0; j < 4; ++j) {
+						w.set(REF(i, j), OPER12(static_cast<double>(i * 4 + j)));
+					}
+				}
+				w.set(REF(1, 1), OPER12(L"a string longer than inline"));
+				w.set(REF(9, 9), OPER12(L"ab"));
+				size_t calls = h.callbacks;
+				ensure(w.flush() == 2);
+				ensure(h.callbacks == calls + 2);
+				ensure(w.size() == 0);
+			}
+			ensure(h.sheet.size() == 13);
+			ensure(h.sheet.at(std::make_pair(2, 3)) == 11.);
+			ensure(h.sheet.at(std::make_pair(1, 1)) == L"a string longer than inline");
+			ensure(h.sheet.at(std::make_pair(9, 9)) == L"ab");
+
+			h.fail[xlSet] = xlretFailed;
+			size_t calls = h.callbacks;
+			{
+				range_writer w;
+				w.set(REF(0, 0), OPER12(1.));
+				bool thrown = false;
+				try {
+					w.flush();
+				}
+				catch (const std::exception&) {
+					thrown = true;
+				}
+				ensure(thrown);
+				ensure(w.size() == 0);
+			}
+			ensure(h.callbacks == calls + 1); // destructor did not flush again
+		}
+	}
+#endif // _DEBUG
+
+} // namespace xll
@@ -6,14 +6,9 @@
 #include <type_traits>
 #include <Windows.h>
 #include "XLCALL.H"
-
-/*
-template<wchar_t... cs>
-constexpr auto operator""_wp()
-{
-	return std::array{ sizeof...(cs), cs... }
-}
-*/
+#ifdef XLL_INSTRUMENT
+#include "instrument.h"
+#endif
 
 namespace xll {
 
@@ -42,6 +37,10 @@ namespace xll {
 	concept XlOper
 		= std::is_base_of_v<XLOPER, X> || std::is_base_of_v<XLOPER12, X>;
 
+	// SDK struct X is derived from.
+	template<XlOper X>
+	using xloper_t = std::conditional_t<std::is_base_of_v<XLOPER12, X>, XLOPER12, XLOPER>;
+
 	template<class X, class Y>
 	concept both_xloper
 		= std::is_base_of_v<XLOPER, X>&& std::is_base_of_v<XLOPER, Y>;
@@ -73,16 +72,22 @@ namespace xll {
 		using type = XLOPER;
 		using xchar = CHAR;
 		using charx = XCHAR;
-		static const size_t str_max = 0x100;
+		static constexpr size_t str_max = 0x100;
 		using xref = XLREF;
 		// Multi
 		using xrw = WORD;
 		using xcol = WORD;
-		static const size_t rw_max = 0x10000;
-		static const size_t col_max = 0x100;
+		static constexpr size_t rw_max = 0x10000;
+		static constexpr size_t col_max = 0x100;
+		// Most arguments in a callback.
+		static constexpr int arg_max = 30;
 		static int Excelv(int xlfn, LPXLOPER operRes, int count, LPXLOPER opers[])
 		{
+#ifdef XLL_INSTRUMENT
+			return instrument::call(xlfn, [=] { return ::Excel4v(xlfn, operRes, count, opers); });
+#else
 			return ::Excel4v(xlfn, operRes, count, opers);
+#endif
 		}
 	};
 
@@ -90,16 +95,22 @@ namespace xll {
 		using type = XLOPER12;
 		using xchar = XCHAR;
 		using charx = CHAR;
-		static const size_t str_max = 0x8000;
+		static constexpr size_t str_max = 0x8000;
 		using xref = XLREF12;
 		// Multi
 		using xrw = INT32;
 		using xcol = INT32;
-		static const size_t rw_max = 0x100000;
-		static const size_t col_max = 0x4000;
+		static constexpr size_t rw_max = 0x100000;
+		static constexpr size_t col_max = 0x4000;
+		// Most arguments in a callback.
+		static constexpr int arg_max = 255;
 		static int Excelv(int xlfn, LPXLOPER12 operRes, int count, LPXLOPER12 opers[])
 		{
+#ifdef XLL_INSTRUMENT
+			return instrument::call(xlfn, [=] { return ::Excel12v(xlfn, operRes, count, opers); });
+#else
 			return ::Excel12v(xlfn, operRes, count, opers);
+#endif
 		}
 	};
 
@@ -117,5 +128,59 @@ namespace xll {
 		using xloper = XLOPER12;
 	};
 
+	// Counted string built at compile time from a string literal.
+	template<is_char T, size_t N>
+	struct counted_literal {
+		using xchar = T;
+		using xloper = traits<T>::xloper;
+		static constexpr size_t size = N - 1;
+		static_assert(size < traits<xloper>::str_max);
+		T str[N]; // str[0] is the count and there is no terminating null
+
+		constexpr counted_literal(const T(&s)[N])
+			: str{}
+		{
+			str[0] = static_cast<T>(size);
+			for (size_t i = 0; i < size; ++i) {
+				str[i + 1] = s[i];
+			}
+		}
+	};
+
+	inline namespace literals {
+
+		// L"abc"_wp is a counted XCHAR string in read-only data.
+		template<counted_literal S>
+			requires std::is_same_v<XCHAR, typename decltype(S)::xchar>
+		constexpr const XCHAR* operator""_wp()
+		{
+			return S.str;
+		}
+		// "abc"_cp is a counted CHAR string in read-only data.
+		template<counted_literal S>
+			requires std::is_same_v<CHAR, typename decltype(S)::xchar>
+		constexpr const CHAR* operator""_cp()
+		{
+			return S.str;
+		}
+
+	} // namespace literals
+
+#ifdef _DEBUG
+	inline void test_counted_literal()
+	{
+		{
+			constexpr const XCHAR* s = L"abc"_wp;
+			static_assert(3 == s[0]);
+			static_assert(L'c' == s[3]);
+			static_assert(s == L"abc"_wp); // one copy per literal
+		}
+		{
+			constexpr const CHAR* s = ""_cp;
+			static_assert(0 == s[0]);
+		}
+	}
+#endif // _DEBUG
+
 
 } // namespace xll